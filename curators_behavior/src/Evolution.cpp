@@ -1,41 +1,207 @@
 #include <iostream>
 #include "GolosEconomy.h"
 #include "Utils.h"
+#include "Sweep.h"
+#include "ResultCache.h"
 
 #include <iomanip>
 #include <iostream>
 #include <vector>
 #include <future>
+#include <mutex>
+#include <chrono>
+#include <cctype>
 #include <nlopt.hpp>
 
 #include <functional>
 #include <boost/asio/thread_pool.hpp>
 #include <boost/asio.hpp>
 #include <boost/filesystem.hpp>
+#include <unistd.h>
 
 
-int main(int argc, char* argv[])
+struct Arguments
 {
-	std::string inputEnvironmentsFolder((argc > 1) ? argv[1] : "");
+	std::string inputEnvironmentsFolder;
+	std::string outputEnvironmentsFolder = "environments_output";
+	std::string settingsFileName = "Settings.xml";
+	std::string sweepFileName;
+	std::string cacheFolder;
+	std::vector<std::string> overrideFiles;
+	std::vector<std::string> assignments;
+	Arguments(int argc, char* argv[]);
+};
 
-	std::list<Environment> environments;
+Arguments::Arguments(int argc, char* argv[])
+{
+	//Evolution [inputFolder] [--input folder] [--output folder] [--settings file]
+	//          [--override file]... [--set [+]path.attr=value]... [--sweep file] [--cache folder]
+	for(int i = 1; i < argc; i++)
+	{
+		std::string arg(argv[i]);
+		bool hasValue = (i + 1 < argc);
+		if((arg == "--settings") && hasValue)
+			settingsFileName = argv[++i];
+		else if((arg == "--override") && hasValue)
+			overrideFiles.emplace_back(argv[++i]);
+		else if((arg == "--set") && hasValue)
+			assignments.emplace_back(argv[++i]);
+		else if((arg == "--sweep") && hasValue)
+			sweepFileName = argv[++i];
+		else if((arg == "--cache") && hasValue)
+			cacheFolder = argv[++i];
+		else if((arg == "--input") && hasValue)
+			inputEnvironmentsFolder = argv[++i];
+		else if((arg == "--output") && hasValue)
+			outputEnvironmentsFolder = argv[++i];
+		else if((arg.compare(0, 2, "--") != 0) && inputEnvironmentsFolder.empty())
+			inputEnvironmentsFolder = arg;
+		else
+			throw std::runtime_error(std::string("unknown or incomplete argument: ") + arg);
+	}
+}
 
-	boost::asio::thread_pool pool(Settings::attribute("main", "threads").as_uint());
-	size_t i = 0;
-	std::string rulePath(std::string("rules._") + std::to_string(i));
-	while((i < Settings::attribute("main", "rulesLimit").as_uint()) && Settings::exist(rulePath))
+//Острова (population.islands num > 1): реплики окружения обмениваются мигрантами через разделяемую память.
+//Без channel все острова задачи считаются в потоках этого процесса, результат - остров 0,
+//остальные пишут файлы с суффиксом _island<N>. С channel процесс считает только остров index,
+//остальные запускаются отдельными процессами с тем же channel. Если процесс острова упал,
+//сегмент channel остается в /dev/shm с его записями и удаляется вручную.
+static Environment::Metrics runJob(const Sweep::Job& job, size_t jobNum)
+{
+	size_t islandsNum = 1;
+	size_t island = 0;
+	std::string channelName;
+	{
+		Settings::Scope scope(job.settings);
+		if(Settings::exist("population.islands", "num"))
+			islandsNum = std::max(Settings::attribute("population.islands", "num").as_uint(), 1u);
+		if(Settings::exist("population.islands", "channel"))
+		{
+			channelName = Settings::attribute("population.islands", "channel").as_string();
+			island = Settings::attribute("population.islands", "index").as_uint();
+		}
+	}
+	auto runIsland = [&job, islandsNum](const std::string& channel, size_t island)
 	{
-		for(size_t j = 0; j < Settings::attribute("main", "copies").as_uint(); j++)
+		Rnd::seed(job.seed ? static_cast<unsigned>(job.seed + (island * 7919)) : 0);
+		Environment environment(job.settings, Environment::getIslandFileName(job.resultFileName, island), job.inputFileName);
+		if(islandsNum > 1)
+			environment.joinIslands(channel, islandsNum, island);
+		environment.run(job.rulePath);
+		return environment.getMetrics();
+	};
+	if((islandsNum == 1) || !channelName.empty())
+		return runIsland(channelName, island);
+
+	channelName = std::string("/golos_islands_") + std::to_string(getpid()) + "_" + std::to_string(jobNum);
+	std::vector<std::future<Environment::Metrics> > islands;
+	for(size_t i = 1; i < islandsNum; i++)
+		islands.emplace_back(std::async(std::launch::async, runIsland, channelName, i));
+	auto metrics = runIsland(channelName, 0);
+	for(auto& i : islands)
+		i.get();
+	metrics["islands"] = static_cast<double>(islandsNum);
+	return metrics;
+}
+
+int main(int argc, char* argv[])
+{
+	Arguments args(argc, argv);
+	auto settings = Settings::load(args.settingsFileName, args.overrideFiles, args.assignments);
+	Settings::setDefault(settings);
+	std::cout << "settings hash = " << settings->hash() << std::endl;
+	boost::filesystem::create_directories(args.outputEnvironmentsFolder);
+
+	Sweep sweep;
+	if(!args.sweepFileName.empty())
+		sweep = Sweep(args.sweepFileName);
+	auto jobs = sweep.makeJobs(settings, args.inputEnvironmentsFolder, args.outputEnvironmentsFolder);
+	ResultCache cache(args.cacheFolder);
+	std::vector<std::string> keys(jobs.size());
+	std::vector<Sweep::Job*> order;
+	for(size_t k = 0; k < jobs.size(); k++)
+	{
+		auto& job = jobs[k];
+		//при seed = 0 результат зависит от std::random_device и не кэшируется
+		if(cache.enabled() && job.seed)
 		{
-			std::string numStr = std::to_string(i) + "_" + std::to_string(j);
-			std::string inputFileName;
-			if(!inputEnvironmentsFolder.empty())
-				inputFileName = inputEnvironmentsFolder + "/_" + numStr + ".xml";
-			environments.emplace_back(Environment(std::string("environments_output/_") + numStr + ".xml", inputFileName));
-			boost::asio::post(pool, std::bind(&Environment::run, &(environments.back()), rulePath));
+			keys[k] = ResultCache::makeKey(*job.settings, job.rulePath, job.seed, job.copy,
+					job.inputFileName, Environment::getVersion());
+			ResultCache::Entry entry;
+			if(cache.find(keys[k], entry))
+			{
+				ResultCache::restore(entry, job.resultFileName);
+				job.settings->save(Environment::getSettingsFileName(job.resultFileName));
+				job.status = "cached";
+				job.metrics = entry.metrics;
+				continue;
+			}
 		}
-		rulePath = std::string("rules._") + std::to_string(++i);
+		order.push_back(&job);
 	}
+	Sweep::orderByCost(order);
+	std::cout << "jobs = " << jobs.size() << ", cached = " << (jobs.size() - order.size()) << std::endl;
+
+	std::string resultsFileName = args.outputEnvironmentsFolder + "/sweep_results.tsv";
+	sweep.writeResults(resultsFileName, jobs);
+	std::mutex resultsMutex;
+	boost::asio::thread_pool pool(Settings::attribute("main", "threads").as_uint());
+	for(auto job : order)
+		boost::asio::post(pool, [job, &jobs, &keys, &cache, &sweep, &resultsMutex, &resultsFileName]()
+		{
+			std::string status("ok");
+			Environment::Metrics metrics;
+			auto startTime = std::chrono::steady_clock::now();
+			const std::string& key = keys[job - jobs.data()];
+			bool locked = false;
+			try
+			{
+				ResultCache::Entry entry;
+				bool cached = false;
+				//другой процесс может уже считать ту же конфигурацию
+				while(cache.enabled() && !key.empty() && !locked && !cached)
+				{
+					if(!(cached = cache.find(key, entry)) && !(locked = cache.lock(key)))
+						cached = cache.wait(key, entry);
+				}
+				if(cached)
+				{
+					ResultCache::restore(entry, job->resultFileName);
+					job->settings->save(Environment::getSettingsFileName(job->resultFileName));
+					status = "cached";
+					metrics = entry.metrics;
+				}
+				else
+				{
+					metrics = runJob(*job, job - jobs.data());
+					if(locked)
+						cache.store(key, job->resultFileName,
+								Environment::getSettingsFileName(job->resultFileName), metrics);
+				}
+			}
+			catch(const std::exception& e)
+			{
+				status = std::string("failed: ") + e.what();
+				std::replace_if(status.begin(), status.end(), [](char c){return std::isspace(static_cast<unsigned char>(c));}, ' ');
+				std::cerr << job->resultFileName << ": " << e.what() << std::endl;
+			}
+			if(locked)
+				cache.unlock(key);
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - startTime;
+
+			std::lock_guard<std::mutex> lock(resultsMutex);
+			job->status = status;
+			job->seconds = elapsed.count();
+			job->metrics = std::move(metrics);
+			try
+			{
+				sweep.writeResults(resultsFileName, jobs);
+			}
+			catch(const std::exception& e)
+			{
+				std::cerr << e.what() << std::endl;
+			}
+		});
 	pool.join();
 	std::cout << "done." << std::endl;
 	return 0;
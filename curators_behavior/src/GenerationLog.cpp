@@ -0,0 +1,344 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "GenerationLog.h"
+
+constexpr char GenerationLog::MAGIC[4];
+constexpr uint32_t GenerationLog::VERSION;
+constexpr uint32_t GenerationLog::KEYFRAME;
+
+namespace
+{
+	constexpr size_t MIN_GROWTH = 1 << 20;
+	constexpr size_t MAX_GROWTH = 256 << 20;
+
+	size_t align8(size_t size) {return (size + 7) & ~static_cast<size_t>(7);};
+
+	bool littleEndianHost()
+	{
+		const uint16_t probe = 1;
+		return *reinterpret_cast<const uint8_t*>(&probe) == 1;
+	}
+
+	size_t getRecordSize(const GenerationLog::Record& record, size_t genesNum)
+	{
+		return sizeof(GenerationLog::Record) + align8(record.stratsNum * sizeof(float)) +
+				(record.birthsNum * (sizeof(GenerationLog::Birth) + (genesNum * sizeof(double)))) +
+				(record.movesNum * sizeof(GenerationLog::Move));
+	}
+};
+
+template<class T>
+void GenerationLog::put(const T& val, size_t offset)
+{
+	std::memcpy(static_cast<char*>(_data) + offset, &val, sizeof(T));
+}
+
+GenerationLog::GenerationLog(const std::string& fileName, const PopulationArchive::Layout& layout, size_t populationsNum) :
+		_fileName(fileName), _fd(-1), _data(nullptr), _capacity(0), _pos(0), _record(0),
+		_genesNum(layout.getGenesNum()), _current(), _open(false)
+{
+	if(!littleEndianHost())
+		throw std::runtime_error("GenerationLog: big-endian hosts are not supported");
+	_fd = open(fileName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(_fd < 0)
+		throw std::runtime_error(std::string("GenerationLog: can't open file: ") + fileName);
+
+	size_t layoutSize = align8(sizeof(uint32_t) * (2 + layout.phenosizes.size() + layout.featureTypes.size()));
+	try
+	{
+		reserve(sizeof(Header) + layoutSize);
+	}
+	catch(...)
+	{
+		close(_fd);
+		throw;
+	}
+	std::memcpy(getHeader()->magic, MAGIC, sizeof(MAGIC));
+	getHeader()->version = VERSION;
+	getHeader()->settingsHash = layout.settingsHash;
+	getHeader()->genesNum = static_cast<uint32_t>(_genesNum);
+	getHeader()->populationsNum = static_cast<uint32_t>(populationsNum);
+	getHeader()->recordsOffset = sizeof(Header) + layoutSize;
+	_pos = sizeof(Header);
+	put<uint32_t>(layout.phenosizes.size(), _pos);
+	put<uint32_t>(layout.featureTypes.size(), _pos + sizeof(uint32_t));
+	_pos += 2 * sizeof(uint32_t);
+	for(auto s : layout.phenosizes)
+	{
+		put<uint32_t>(s, _pos);
+		_pos += sizeof(uint32_t);
+	}
+	for(auto t : layout.featureTypes)
+	{
+		put<uint32_t>(t, _pos);
+		_pos += sizeof(uint32_t);
+	}
+	_pos = sizeof(Header) + layoutSize;
+	getHeader()->committed.store(_pos, std::memory_order_release);
+}
+
+GenerationLog::~GenerationLog()
+{
+	//незавершенная запись отбрасывается, зарезервированный хвост обрезается
+	if(_data)
+	{
+		size_t committed = getHeader()->committed.load();
+		munmap(_data, _capacity);
+		//из деструктора исключение не бросить, читатели и без обрезки остановятся на committed
+		if(ftruncate(_fd, static_cast<off_t>(committed)))
+			std::cerr << "GenerationLog: can't truncate file: " << _fileName << std::endl;
+	}
+	close(_fd);
+}
+
+void GenerationLog::reserve(size_t size)
+{
+	if(_pos + size <= _capacity)
+		return;
+	size_t capacity = _pos + size + std::min(std::max(_capacity, MIN_GROWTH), MAX_GROWTH);
+	capacity = (capacity + MIN_GROWTH - 1) & ~(MIN_GROWTH - 1);
+	//место выделяется сразу: нехватка диска - исключение здесь, а не SIGBUS при записи в память
+	if(posix_fallocate(_fd, static_cast<off_t>(_capacity), static_cast<off_t>(capacity - _capacity)))
+		throw std::runtime_error(std::string("GenerationLog::reserve: can't allocate file space: ") + _fileName);
+	void* data = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+	if(data == MAP_FAILED)
+		throw std::runtime_error(std::string("GenerationLog::reserve: can't map file: ") + _fileName);
+	if(_data)
+		munmap(_data, _capacity);
+	_data = data;
+	_capacity = capacity;
+}
+
+void GenerationLog::begin(size_t population, uint64_t generation, uint64_t cycle, size_t stratsNum, size_t clansNum, bool keyframe)
+{
+	if(_open)
+		throw std::logic_error("GenerationLog::begin: previous record is not committed");
+	_pos = getHeader()->committed.load(std::memory_order_relaxed);
+	_record = _pos;
+	_current = Record();
+	_current.generation = generation;
+	_current.cycle = cycle;
+	_current.population = static_cast<uint32_t>(population);
+	_current.flags = keyframe ? KEYFRAME : 0;
+	_current.stratsNum = static_cast<uint32_t>(stratsNum);
+	_current.clansNum = static_cast<uint32_t>(clansNum);
+	size_t size = sizeof(Record) + align8(stratsNum * sizeof(float));
+	reserve(size);
+	std::memset(static_cast<char*>(_data) + _pos, 0, size);
+	_pos += size;
+	_open = true;
+}
+
+void GenerationLog::setUtility(size_t slot, double val)
+{
+	if(slot >= _current.stratsNum)
+		throw std::out_of_range("GenerationLog::setUtility: wrong slot");
+	put<float>(static_cast<float>(val), _record + sizeof(Record) + (slot * sizeof(float)));
+}
+
+void GenerationLog::addBirth(const Birth& birth, const double* genes)
+{
+	if(_current.movesNum)
+		throw std::logic_error("GenerationLog::addBirth: births must precede moves");
+	reserve(sizeof(Birth) + (_genesNum * sizeof(double)));
+	put(birth, _pos);
+	std::memcpy(static_cast<char*>(_data) + _pos + sizeof(Birth), genes, _genesNum * sizeof(double));
+	_pos += sizeof(Birth) + (_genesNum * sizeof(double));
+	++_current.birthsNum;
+}
+
+void GenerationLog::addMove(size_t slot, size_t clan)
+{
+	reserve(sizeof(Move));
+	put(Move{static_cast<uint32_t>(slot), static_cast<uint32_t>(clan)}, _pos);
+	_pos += sizeof(Move);
+	++_current.movesNum;
+}
+
+void GenerationLog::commit()
+{
+	if(!_open)
+		throw std::logic_error("GenerationLog::commit: no record");
+	_current.size = _pos - _record;
+	put(_current, _record);
+	getHeader()->committed.store(_pos, std::memory_order_release);
+	_open = false;
+}
+
+bool GenerationLogReader::check(const std::string& fileName)
+{
+	std::ifstream file(fileName, std::ios::binary);
+	char magic[sizeof(GenerationLog::MAGIC)] = {};
+	return file.read(magic, sizeof(magic)) && !std::memcmp(magic, GenerationLog::MAGIC, sizeof(magic));
+}
+
+GenerationLogReader::GenerationLogReader(const std::string& fileName) : _data(nullptr), _size(0), _genesNum(0), _settingsHash(0)
+{
+	if(!littleEndianHost())
+		throw std::runtime_error("GenerationLogReader: big-endian hosts are not supported");
+	int fd = open(fileName.c_str(), O_RDONLY);
+	if(fd < 0)
+		throw std::runtime_error(std::string("GenerationLogReader: can't open file: ") + fileName);
+	struct stat st;
+	if(fstat(fd, &st) || (static_cast<size_t>(st.st_size) < sizeof(GenerationLog::Header)))
+	{
+		close(fd);
+		throw std::runtime_error(std::string("GenerationLogReader: can't stat file: ") + fileName);
+	}
+	_size = static_cast<size_t>(st.st_size);
+	_data = mmap(nullptr, _size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(_data == MAP_FAILED)
+	{
+		_data = nullptr;
+		throw std::runtime_error(std::string("GenerationLogReader: can't map file: ") + fileName);
+	}
+
+	try
+	{
+		const char* data = static_cast<const char*>(_data);
+		const auto& header = *reinterpret_cast<const GenerationLog::Header*>(data);
+		if(std::memcmp(header.magic, GenerationLog::MAGIC, sizeof(GenerationLog::MAGIC)))
+			throw std::runtime_error(std::string("GenerationLogReader: wrong magic: ") + fileName);
+		if(header.version != GenerationLog::VERSION)
+			throw std::runtime_error(std::string("GenerationLogReader: unsupported version: ") + fileName);
+		//журнал могут дописывать: читаются только завершенные записи
+		size_t committed = header.committed.load(std::memory_order_acquire);
+		if((committed > _size) || (header.recordsOffset > committed) || (header.recordsOffset % 8))
+			throw std::runtime_error(std::string("GenerationLogReader: wrong records bounds: ") + fileName);
+		_settingsHash = header.settingsHash;
+		_genesNum = header.genesNum;
+		_records.resize(header.populationsNum);
+
+		size_t pos = sizeof(GenerationLog::Header);
+		auto take = [data, &header, &pos, &fileName]()
+		{
+			if(pos + sizeof(uint32_t) > header.recordsOffset)
+				throw std::runtime_error(std::string("GenerationLogReader: wrong layout: ") + fileName);
+			uint32_t ret;
+			std::memcpy(&ret, data + pos, sizeof(ret));
+			pos += sizeof(ret);
+			return ret;
+		};
+		_phenosizes.resize(take());
+		_featureTypes.resize(take());
+		for(auto& s : _phenosizes)
+			s = take();
+		for(auto& t : _featureTypes)
+			t = take();
+
+		for(pos = header.recordsOffset; pos < committed;)
+		{
+			if(pos + sizeof(GenerationLog::Record) > committed)
+				throw std::runtime_error(std::string("GenerationLogReader: truncated record: ") + fileName);
+			const auto& record = getRecord(pos);
+			if((record.size != getRecordSize(record, _genesNum)) || (pos + record.size > committed) ||
+					(record.population >= _records.size()) || (record.generation != _records[record.population].size()) ||
+					(_records[record.population].empty() && !(record.flags & GenerationLog::KEYFRAME)))
+				throw std::runtime_error(std::string("GenerationLogReader: inconsistent record: ") + fileName);
+			_records[record.population].push_back(pos);
+			pos += record.size;
+		}
+	}
+	catch(...)
+	{
+		munmap(_data, _size);
+		throw;
+	}
+}
+
+GenerationLogReader::~GenerationLogReader()
+{
+	if(_data)
+		munmap(_data, _size);
+}
+
+void GenerationLogReader::apply(size_t offset, State& state)const
+{
+	const auto& record = getRecord(offset);
+	if(record.flags & GenerationLog::KEYFRAME)
+	{
+		state.genes.assign(record.stratsNum * _genesNum, 0.0);
+		state.ids.assign(record.stratsNum, 0);
+		state.parents.assign(record.stratsNum, {0, 0});
+		state.origins.assign(record.stratsNum, GenerationLog::INITIAL);
+		state.clans.assign(record.stratsNum, 0);
+	}
+	else if(state.ids.size() != record.stratsNum)
+		throw std::runtime_error("GenerationLogReader::apply: population size changed without keyframe");
+	state.generation = record.generation;
+	state.cycle = record.cycle;
+	state.clansNum = record.clansNum;
+
+	const char* pos = static_cast<const char*>(_data) + offset + sizeof(GenerationLog::Record);
+	state.utilities.resize(record.stratsNum);
+	std::memcpy(state.utilities.data(), pos, record.stratsNum * sizeof(float));
+	pos += align8(record.stratsNum * sizeof(float));
+	for(size_t b = 0; b < record.birthsNum; b++)
+	{
+		GenerationLog::Birth birth;
+		std::memcpy(&birth, pos, sizeof(birth));
+		if(birth.slot >= record.stratsNum)
+			throw std::runtime_error("GenerationLogReader::apply: wrong slot");
+		state.ids[birth.slot] = birth.id;
+		state.parents[birth.slot] = birth.parents;
+		state.origins[birth.slot] = birth.origin;
+		std::memcpy(state.genes.data() + (birth.slot * _genesNum), pos + sizeof(birth), _genesNum * sizeof(double));
+		pos += sizeof(birth) + (_genesNum * sizeof(double));
+	}
+	for(size_t m = 0; m < record.movesNum; m++)
+	{
+		GenerationLog::Move move;
+		std::memcpy(&move, pos, sizeof(move));
+		if((move.slot >= record.stratsNum) || (move.clan >= record.clansNum))
+			throw std::runtime_error("GenerationLogReader::apply: wrong move");
+		state.clans[move.slot] = move.clan;
+		pos += sizeof(move);
+	}
+}
+
+void GenerationLogReader::restore(size_t population, size_t generation, State& state)const
+{
+	const auto& records = _records.at(population);
+	if(generation >= records.size())
+		throw std::out_of_range("GenerationLogReader::restore: wrong generation");
+	size_t first = generation;
+	while(!(getRecord(records[first]).flags & GenerationLog::KEYFRAME))
+		--first;//первая запись популяции - опорная, это проверено при чтении
+	for(size_t g = first; g <= generation; g++)
+		apply(records[g], state);
+}
+
+void GenerationLogReader::snapshot(size_t generation, PopulationArchive::Layout& layout, std::vector<double>& genes)const
+{
+	layout.phenosizes = _phenosizes;
+	layout.featureTypes = _featureTypes;
+	layout.settingsHash = _settingsHash;
+	layout.clans.assign(_records.size(), std::vector<uint32_t>());
+	genes.clear();
+	State state;
+	for(size_t p = 0; p < _records.size(); p++)
+	{
+		if(_records[p].empty())
+			continue;
+		restore(p, std::min(generation, _records[p].size() - 1), state);
+		for(size_t clan = 0; clan < state.clansNum; clan++)
+		{
+			uint32_t stratsNum = 0;
+			for(size_t slot = 0; slot < state.clans.size(); slot++)
+				if(state.clans[slot] == clan)
+				{
+					genes.insert(genes.end(), state.genes.begin() + (slot * _genesNum), state.genes.begin() + ((slot + 1) * _genesNum));
+					++stratsNum;
+				}
+			layout.clans[p].push_back(stratsNum);
+		}
+	}
+}
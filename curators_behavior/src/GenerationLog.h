@@ -0,0 +1,143 @@
+#ifndef GENERATIONLOG_H_
+#define GENERATIONLOG_H_
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "PopulationArchive.h"
+
+//Журнал поколений популяций (little-endian): файл только дописывается, запись идет
+//в отображенную память, файл растет кусками, место под них резервируется заранее.
+//  заголовок, размеры фенотипов и типы признаков (как в PopulationArchive),
+//  записи поколений, выровненные на 8 байт: заголовок записи,
+//  сглаженные полезности всех слотов (float), рождения - геномы слотов,
+//  замененные после прошлой записи популяции, с номерами родителей, и переходы слотов между кланами.
+//Опорная запись (KEYFRAME) содержит все слоты и кланы, остальные - разность с предыдущей записью популяции.
+//Заголовок хранит размер завершенных записей: читать файл можно во время моделирования.
+class GenerationLog
+{
+public:
+	static constexpr char MAGIC[4] = {'G', 'L', 'O', 'G'};
+	static constexpr uint32_t VERSION = 1;
+	static constexpr uint32_t KEYFRAME = 1;
+	enum Origin : uint32_t {INITIAL, BRED, IMMIGRANT};
+
+	struct Header
+	{
+		char magic[4];
+		uint32_t version;
+		uint64_t settingsHash;
+		std::atomic<uint64_t> committed;//конец последней завершенной записи
+		uint32_t genesNum;
+		uint32_t populationsNum;
+		uint64_t recordsOffset;
+	};
+	struct Record
+	{
+		uint64_t size;//вместе с заголовком
+		uint64_t generation;//номер записи популяции, 0 - начальная популяция
+		uint64_t cycle;//цикл pick популяции
+		uint32_t population;
+		uint32_t flags;
+		uint32_t stratsNum;
+		uint32_t clansNum;
+		uint32_t birthsNum;
+		uint32_t movesNum;
+	};
+	//за рождением следуют genesNum генов; номера геномов популяции начинаются с 1, 0 - нет родителя
+	struct Birth
+	{
+		uint64_t id;
+		std::array<uint64_t, 2> parents;
+		uint32_t slot;
+		uint32_t origin;
+	};
+	struct Move
+	{
+		uint32_t slot;
+		uint32_t clan;
+	};
+	static_assert(std::atomic<uint64_t>::is_always_lock_free, "GenerationLog: atomics must be lock-free");
+	static_assert((sizeof(Header) == 40) && (sizeof(Record) == 48) && (sizeof(Birth) == 32) && (sizeof(Move) == 8),
+			"GenerationLog: unexpected record layout");
+
+private:
+	std::string _fileName;
+	int _fd;
+	void* _data;
+	size_t _capacity;
+	size_t _pos;//конец текущей записи
+	size_t _record;//начало текущей записи
+	size_t _genesNum;
+	Record _current;
+	bool _open;
+
+	void reserve(size_t size);
+	template<class T>
+	void put(const T& val, size_t offset);
+	Header* getHeader() {return static_cast<Header*>(_data);};
+
+public:
+	GenerationLog(const std::string& fileName, const PopulationArchive::Layout& layout, size_t populationsNum);
+	~GenerationLog();
+	GenerationLog(GenerationLog const&) = delete;
+	void operator=(GenerationLog const&) = delete;
+
+	//запись поколения: begin, полезности, рождения, переходы и commit, незавершенная запись не видна читателям
+	void begin(size_t population, uint64_t generation, uint64_t cycle, size_t stratsNum, size_t clansNum, bool keyframe);
+	void setUtility(size_t slot, double val);
+	void addBirth(const Birth& birth, const double* genes);
+	void addMove(size_t slot, size_t clan);
+	void commit();
+
+	size_t getSize()const {return _pos;};
+	const std::string& getFileName()const {return _fileName;};
+};
+
+//Чтение журнала через mmap: поколение популяции восстанавливается от ближайшей опорной записи
+class GenerationLogReader
+{
+public:
+	struct State
+	{
+		uint64_t generation = 0;
+		uint64_t cycle = 0;
+		size_t clansNum = 0;
+		std::vector<double> genes;//stratsNum x genesNum по слотам
+		std::vector<float> utilities;
+		std::vector<uint64_t> ids;
+		std::vector<std::array<uint64_t, 2> > parents;
+		std::vector<uint32_t> origins;
+		std::vector<uint32_t> clans;//клан слота
+	};
+
+private:
+	void* _data;
+	size_t _size;
+	size_t _genesNum;
+	std::vector<uint32_t> _phenosizes;
+	std::vector<uint32_t> _featureTypes;
+	uint64_t _settingsHash;
+	std::vector<std::vector<size_t> > _records;//смещения записей каждой популяции
+	const GenerationLog::Record& getRecord(size_t offset)const
+		{return *reinterpret_cast<const GenerationLog::Record*>(static_cast<const char*>(_data) + offset);};
+	void apply(size_t offset, State& state)const;
+
+public:
+	explicit GenerationLogReader(const std::string& fileName);
+	~GenerationLogReader();
+	GenerationLogReader(GenerationLogReader const&) = delete;
+	void operator=(GenerationLogReader const&) = delete;
+
+	static bool check(const std::string& fileName);//true, если файл - журнал поколений
+	size_t getPopulationsNum()const {return _records.size();};
+	size_t getGenerationsNum(size_t population)const {return _records.at(population).size();};
+	uint64_t getCycle(size_t population, size_t generation)const
+		{return getRecord(_records.at(population).at(generation)).cycle;};
+	void restore(size_t population, size_t generation, State& state)const;
+	//популяции в поколении generation (или последнем записанном до него) в порядке кланов
+	void snapshot(size_t generation, PopulationArchive::Layout& layout, std::vector<double>& genes)const;
+};
+
+#endif /* GENERATIONLOG_H_ */
@@ -1,19 +1,99 @@
 #include <algorithm>
+#include <limits>
+#include <numeric>
 #include <iostream>
 #include <chrono>
+#include <boost/asio/post.hpp>
 #include "GolosEconomy.h"
 #include "Utils.h"
 
-double Strat::s_expMoving = Settings::get("squelch", "expMoving");
-size_t StratPopulation::s_iterSize = Settings::attribute("population.run", "iterSize").as_uint();
-double StratPopulation::s_elit = Settings::get("population.run", "elit");
-double StratPopulation::s_migrationRate = Settings::get("population.run", "migrationRate");
-bool Environment::s_displayEnable = Settings::attribute("display", "enable").as_bool();
-double User::s_articleRatingLnFactor = Settings::get("article", "ratingLnFactor");
-double User::s_articlePassesLnFactor = Settings::get("article", "passesLnFactor");
-double User::s_initCharge = Settings::get("user", "charge");
-double User::s_straightforwardFactorPower = Settings::get("user", "straightforwardFactorPower");
-size_t User::s_maxPasses  = Settings::attribute("user", "maxPasses").as_uint();
+thread_local double StratMatrix::s_expMoving = 0.0;
+std::atomic<uint64_t> StratMatrix::s_lastRevision(0);
+thread_local size_t StratPopulation::s_iterSize = 0;
+thread_local double StratPopulation::s_elit = 0.0;
+thread_local double StratPopulation::s_migrationRate = 0.0;
+thread_local double StratPopulation::s_steadyWeight = 0.0;
+thread_local size_t StratPopulation::s_steadyReplace = 1;
+thread_local std::vector<StratPopulation::Observation>* StratPopulation::s_observations = nullptr;
+thread_local size_t StratPopulation::s_islandPeriod = 1;
+thread_local size_t StratPopulation::s_islandMigrants = 0;
+thread_local bool StratPopulation::s_commonScenarios = false;
+thread_local bool StratPopulation::s_scenarioTracking = false;
+thread_local size_t StratPopulation::s_scenarioBlock = 0;
+thread_local double StratPopulation::s_archiveMaxWeight = 0.0;
+thread_local size_t StratPopulation::s_surrogateCandidates = 0;
+thread_local double StratPopulation::s_surrogateMinCorrelation = 0.0;
+thread_local double StratPopulation::s_surrogateWindow = 1.0;
+thread_local size_t StratPopulation::s_historyPeriod = 1;
+thread_local size_t StratPopulation::s_historyKeyframe = 64;
+thread_local bool Environment::s_displayEnable = false;
+thread_local double User::s_articleRatingLnFactor = 0.0;
+thread_local double User::s_articlePassesLnFactor = 0.0;
+thread_local double User::s_initCharge = 0.0;
+thread_local double User::s_straightforwardFactorPower = 0.0;
+thread_local size_t User::s_maxPasses = 0;
+
+void StratMatrix::loadSettings()
+{
+	s_expMoving = Settings::get("squelch", "expMoving");
+}
+
+void StratPopulation::loadSettings()
+{
+	s_iterSize = Settings::attribute("population.run", "iterSize").as_uint();
+	s_elit = Settings::get("population.run", "elit");
+	s_migrationRate = Settings::get("population.run", "migrationRate");
+
+	s_steadyWeight = Settings::exist("population.steadyState", "weight") ?
+			Settings::get("population.steadyState", "weight") : 0.0;
+	s_steadyReplace = Settings::exist("population.steadyState", "replace") ?
+			Settings::attribute("population.steadyState", "replace").as_uint() : 1;
+	if((s_steadyWeight > 0.0) && !s_steadyReplace)
+		throw std::runtime_error("StratPopulation::loadSettings: steadyState.replace == 0");
+
+	s_islandPeriod = Settings::exist("population.islands", "period") ?
+			std::max(Settings::attribute("population.islands", "period").as_uint(), 1u) : 1;
+	s_islandMigrants = Settings::exist("population.islands", "migrants") ?
+			Settings::attribute("population.islands", "migrants").as_uint() : 0;
+
+	s_commonScenarios = Settings::exist("population.crn", "enable") &&
+			Settings::attribute("population.crn", "enable").as_bool();
+	s_scenarioTracking = s_commonScenarios || (Settings::exist("population.crn", "track") &&
+			Settings::attribute("population.crn", "track").as_bool());
+	s_scenarioBlock = Settings::exist("population.crn", "block") ?
+			Settings::attribute("population.crn", "block").as_uint() : 0;
+	s_archiveMaxWeight = Settings::exist("population.archive", "maxWeight") ?
+			Settings::get("population.archive", "maxWeight") : 5.0;
+
+	s_surrogateCandidates = Settings::exist("population.surrogate", "candidates") ?
+			Settings::attribute("population.surrogate", "candidates").as_uint() : 0;
+	s_surrogateMinCorrelation = Settings::exist("population.surrogate", "minCorrelation") ?
+			Settings::get("population.surrogate", "minCorrelation") : 0.1;
+	s_surrogateWindow = Settings::exist("population.surrogate", "window") ?
+			std::max(Settings::get("population.surrogate", "window"), 1.0) : 200.0;
+
+	s_historyPeriod = Settings::exist("report.history", "period") ?
+			std::max(Settings::attribute("report.history", "period").as_uint(), 1u) : 1;
+	s_historyKeyframe = Settings::exist("report.history", "keyframe") ?
+			Settings::attribute("report.history", "keyframe").as_uint() : 64;
+}
+
+void User::loadSettings()
+{
+	s_articleRatingLnFactor = Settings::get("article", "ratingLnFactor");
+	s_articlePassesLnFactor = Settings::get("article", "passesLnFactor");
+	s_initCharge = Settings::get("user", "charge");
+	s_straightforwardFactorPower = Settings::get("user", "straightforwardFactorPower");
+	s_maxPasses  = Settings::attribute("user", "maxPasses").as_uint();
+}
+
+void Environment::loadSettings()
+{
+	s_displayEnable = Settings::attribute("display", "enable").as_bool();
+	StratMatrix::loadSettings();
+	StratPopulation::loadSettings();
+	User::loadSettings();
+}
 
 double Article::TextProperties::dist(const Article::TextProperties& rhs)const
 {
@@ -100,100 +180,322 @@ std::unique_ptr<ProjectedDataRepresentation> Environment::makeRepresentation(con
 	return ret;
 }
 
-void  StratPopulation::addStrats(const std::string& stratInitAttrName, size_t stratsNum, size_t clan, bool reset)
+void StratPopulation::initClans(const std::vector<size_t>& clanSizes)
 {
-	_strats.resize(clan + 1);
-	for(size_t g = 0; g < stratsNum; g++)
-		_strats[clan].emplace_back(std::make_shared<Strat>(stratInitAttrName));
-
-	if(reset)
+	waitEvolution();
+	_next.reset();
+	_clans.clear();
+	size_t slot = 0;
+	for(auto clanSize : clanSizes)
 	{
-		std::vector<double> extDistFactors;
-		size_t i = 0;
-		while(Settings::exist("squelch.extDistFactors", std::string("_") + std::to_string(i)))
-			extDistFactors.push_back(Settings::get("squelch.extDistFactors", std::string("_") + std::to_string(i++)));
-		_squelch.init(_strats, extDistFactors);
+		_clans.emplace_back(clanSize);
+		for(auto& s : _clans.back())
+			s = slot++;
 	}
+	_strats.resize(slot);
+	_optimizer->init(_clans.size());
+
+	std::vector<double> extDistFactors;
+	size_t i = 0;
+	while(Settings::exist("squelch.extDistFactors", std::string("_") + std::to_string(i)))
+		extDistFactors.push_back(Settings::get("squelch.extDistFactors", std::string("_") + std::to_string(i++)));
+	_squelch.init(_clans, extDistFactors);
 }
 
 
 void StratPopulation::init(const std::string& stratInitAttrName)
 {
-
-	_strats.clear();
 	size_t clansNum = Settings::attribute("population.init", "clansNum").as_uint();
+	size_t stratsNum = Settings::attribute("population.init", "stratsNum").as_uint();
+	initClans(std::vector<size_t>(clansNum, stratsNum));
 
-	for(size_t i = 0; i < clansNum; i++)
-		addStrats(stratInitAttrName,
-				Settings::attribute("population.init", "stratsNum").as_uint(),
-				i, (i == (clansNum - 1)));
+	pugi::xml_node node = Settings::getNode(stratInitAttrName);
+	for(size_t slot = 0; slot < _strats.size(); slot++)
+		_strats.init(slot, node);
 	initIterations();
 }
 
 void StratPopulation::init(const pugi::xml_node& node)
 {
-	_strats.clear();
-
+	std::vector<size_t> clanSizes;
 	Xml::NodesList clanNodes(node, "clan_");
 	while(!clanNodes.finished())
 	{
-		_strats.emplace_back(std::vector<std::shared_ptr<Strat> >());
-		auto& clan = _strats.back();
+		clanSizes.push_back(0);
 		Xml::NodesList stratNodes(clanNodes.get(), "strat_");
 		while(!stratNodes.finished())
 		{
-			clan.emplace_back( std::make_shared<Strat>(stratNodes.get()));
+			++clanSizes.back();
 			stratNodes.next();
 		}
 		clanNodes.next();
 	}
+	initClans(clanSizes);
 
-	std::vector<double> extDistFactors;
-	size_t i = 0;
-	while(Settings::exist("squelch.extDistFactors", std::string("_") + std::to_string(i)))
-		extDistFactors.push_back(Settings::get("squelch.extDistFactors", std::string("_") + std::to_string(i++)));
-	_squelch.init(_strats, extDistFactors);
+	size_t slot = 0;
+	Xml::NodesList filledClanNodes(node, "clan_");
+	while(!filledClanNodes.finished())
+	{
+		Xml::NodesList stratNodes(filledClanNodes.get(), "strat_");
+		while(!stratNodes.finished())
+		{
+			_strats.init(slot++, stratNodes.get());
+			stratNodes.next();
+		}
+		filledClanNodes.next();
+	}
 	initIterations();
 }
 
-void StratPopulation::print(const std::string& name, std::ofstream& file)const
+void StratPopulation::init(const PopulationArchive& archive, size_t populationNum)
 {
-	file << "<" << name << ">\n";
-	for(size_t clanN = 0; clanN < _strats.size(); clanN++)
+	const auto& layout = archive.getLayout();
+	if(!std::equal(layout.phenosizes.begin(), layout.phenosizes.end(),
+			Strat::PHENOSIZES.begin(), Strat::PHENOSIZES.end()))
+		throw std::runtime_error("StratPopulation::init: archive has different phenotypes");
+	std::vector<Strat::FeatureType> featureTypes;
+	for(auto t : layout.featureTypes)
 	{
-		std::string clanName = std::string("clan_") + std::to_string(clanN);
-		file << "<" << clanName << ">\n";
-		for(size_t groupN = 0; groupN < _strats[clanN].size(); groupN++)
-			_strats[clanN][groupN]->print(std::string("strat_") + std::to_string(groupN), file);
-		file << "</" << clanName << ">\n";
+		if(t >= static_cast<uint32_t>(Strat::FeatureType::UNDEF))
+			throw std::runtime_error("StratPopulation::init: unknown feature type in archive");
+		featureTypes.push_back(static_cast<Strat::FeatureType>(t));
 	}
-	file << "</" << name << ">\n";
+
+	const auto& clans = layout.clans[populationNum];
+	initClans(std::vector<size_t>(clans.begin(), clans.end()));
+	//строки популяции лежат в архиве подряд, копируем их одним блоком
+	if(!_strats.size())
+		throw std::runtime_error("StratPopulation::init: empty population in archive");
+	_strats.init(0, archive.getGenes(populationNum, 0, 0), _strats.size(), featureTypes);
+	initIterations();
 }
 
-double Strat::getObservation(bool strict) const
+void StratPopulation::write(PopulationArchive::Layout& layout, std::vector<double>& genes)const
 {
-	if(_weight > 0)
-		return _expUtility;
+	layout.clans.emplace_back();
+	for(const auto& clan : _clans)
+	{
+		layout.clans.back().push_back(clan.size());
+		for(auto slot : clan)
+			genes.insert(genes.end(), _strats.getGenes(slot), _strats.getGenes(slot) + Strat::getGenesNum());
+	}
+}
+
+double StratMatrix::getObservation(size_t slot, bool strict) const
+{
+	if(_weight[slot] > 0)
+		return _expUtility[slot];
 	if(strict)
-		throw std::logic_error("Population::StratGroup::getObservation");
+		throw std::logic_error("StratMatrix::getObservation");
 	else return 0.0;
 };
 
-void Strat::pushObservatedUtility(double val)
+void StratMatrix::pushObservatedUtility(size_t slot, double val)
 {
-	if(_weight > 0)
+	double& weight = _weight[slot];
+	double& expUtility = _expUtility[slot];
+	if(weight > 0)
 	{
-		double w0 = (1.0 - s_expMoving) * _weight;
-		_weight = w0 + 1.0;
-		_expUtility = ((w0 * _expUtility) + val) / _weight;
+		double w0 = (1.0 - s_expMoving) * weight;
+		weight = w0 + 1.0;
+		expUtility = ((w0 * expUtility) + val) / weight;
 	}
 	else
 	{
-		_expUtility = val;
-		_weight = 1.0;
+		expUtility = val;
+		weight = 1.0;
+	}
+}
+
+FitnessArchive::FitnessArchive(const std::string& path) : _quantum(1.0)
+{
+	size_t capacity = Settings::exist(path, "capacity") ? Settings::attribute(path, "capacity").as_uint() : 0;
+	if(!capacity)
+		return;
+	_quantum = Settings::exist(path, "quantum") ? Settings::get(path, "quantum") : 0.1;
+	if(_quantum <= 0.0)
+		throw std::runtime_error("FitnessArchive::FitnessArchive: quantum <= 0");
+	size_t size = 1;
+	while(size < capacity)
+		size <<= 1;
+	_cells.resize(size);
+}
+
+uint64_t FitnessArchive::getKey(const StratMatrix& strats, size_t slot)
+{
+	if(_keys.size() != strats.size())
+	{
+		_keys.assign(strats.size(), 0);
+		_revisions.assign(strats.size(), 0);//ревизии начинаются с 1
+	}
+	if(_revisions[slot] != strats.getRevision(slot))
+	{
+		const double* genes = strats.getGenes(slot);
+		uint64_t key = 0;
+		for(size_t g = 0; g < Strat::getGenesNum(); g++)
+			key = Rnd::hash(key ^ static_cast<uint64_t>(static_cast<int64_t>(std::floor(genes[g] / _quantum))));
+		_keys[slot] = key | 1;
+		_revisions[slot] = strats.getRevision(slot);
+	}
+	return _keys[slot];
+}
+
+void FitnessArchive::push(uint64_t key, double val, size_t cycle)
+{
+	Cell& cell = _cells[key & (_cells.size() - 1)];
+	double weight = cell.key ? (cell.weight * getDecay(cycle - cell.cycle)) : 0.0;
+	if(cell.key != key)
+	{
+		if(weight >= 1.0)
+			return;
+		cell.key = key;
+		weight = 0.0;
+	}
+	cell.utility = ((weight * cell.utility) + val) / (weight + 1.0);
+	cell.weight = weight + 1.0;
+	cell.cycle = cycle;
+}
+
+std::pair<double, double> FitnessArchive::get(uint64_t key, size_t cycle)const
+{
+	const Cell& cell = _cells[key & (_cells.size() - 1)];
+	if(cell.key != key)
+		return std::make_pair(0.0, 0.0);
+	return std::make_pair(cell.weight * getDecay(cycle - cell.cycle), cell.utility);
+}
+
+void StratSurrogate::build(const StratMatrix& strats, double distFactor)
+{
+	const size_t genesNum = Strat::getGenesNum();
+	_distFactor = distFactor;
+	_genes.clear();
+	_utility.clear();
+	_weight.clear();
+	for(size_t slot = 0; slot < strats.size(); slot++)
+		if(strats.getWeight(slot) > 0.0)
+		{
+			_genes.insert(_genes.end(), strats.getGenes(slot), strats.getGenes(slot) + genesNum);
+			_utility.push_back(strats.getObservation(slot));
+			_weight.push_back(strats.getWeight(slot));
+		}
+	if(_predictions.size() != strats.size())
+		_predictions.assign(strats.size(), std::numeric_limits<double>::quiet_NaN());
+}
+
+double StratSurrogate::predict(const double* genes)const
+{
+	const size_t genesNum = Strat::getGenesNum();
+	double sum = 0.0;
+	double sumW = 0.0;
+	for(size_t i = 0; i < _weight.size(); i++)
+	{
+		double w = _weight[i] / (1.0 + (_distFactor * Strat::dist(genes, _genes.data() + (i * genesNum))));
+		sum += _utility[i] * w;
+		sumW += w;
+	}
+	return (sumW > 0.0) ? (sum / sumW) : 0.0;
+}
+
+void StratSurrogate::score(const StratMatrix& strats, double window)
+{
+	double decay = 1.0 - (1.0 / window);
+	for(size_t slot = 0; slot < _predictions.size(); slot++)
+		if(!std::isnan(_predictions[slot]) && (strats.getWeight(slot) > 0.0))
+		{
+			double p = _predictions[slot];
+			double o = strats.getObservation(slot);
+			_n = (decay * _n) + 1.0;
+			_p = (decay * _p) + p;
+			_o = (decay * _o) + o;
+			_pp = (decay * _pp) + (p * p);
+			_oo = (decay * _oo) + (o * o);
+			_po = (decay * _po) + (p * o);
+			++_scored;
+			_predictions[slot] = std::numeric_limits<double>::quiet_NaN();
+		}
+}
+
+double StratSurrogate::getCorrelation()const
+{
+	if(_n < 2.0)
+		return 0.0;
+	double cov = _po - ((_p * _o) / _n);
+	double varP = _pp - ((_p * _p) / _n);
+	double varO = _oo - ((_o * _o) / _n);
+	return ((varP > 0.0) && (varO > 0.0)) ? (cov / std::sqrt(varP * varO)) : 0.0;
+}
+
+void StratMatrix::resize(size_t size)
+{
+	_genes.assign(size * Strat::getGenesNum(), 0.0);
+	_powers.assign(size * Strat::getFeaturesNum(), Strat::calcPower(0.0));
+	_weight.assign(size, 0.0);
+	_expUtility.assign(size, 0.0);
+	_smoothedUtility.assign(size, 0.0);
+	_revisions.resize(size);
+	for(auto& revision : _revisions)
+		revision = ++s_lastRevision;
+}
+
+void StratMatrix::updatePowers(size_t slot)
+{
+	const double* genes = getGenes(slot);
+	double* powers = _powers.data() + (slot * Strat::getFeaturesNum());
+	for(size_t phen = 0; phen < Strat::ACTS_COUNT; phen++)
+		for(size_t feature = 0; feature < Strat::PHENOSIZES[phen]; feature++)
+			powers[Strat::getFeatureIndex(phen, feature)] = Strat::calcPower(genes[Strat::getBendIndex(phen, feature)]);
+}
+
+void StratMatrix::onGenesChanged(size_t slot)
+{
+	updatePowers(slot);
+	_revisions[slot] = ++s_lastRevision;
+}
+
+void StratMatrix::init(size_t slot, const pugi::xml_node& node)
+{
+	std::vector<Strat::FeatureType> featureTypes(Strat::getFeaturesNum());
+	Strat::init(getGenes(slot), featureTypes.data(), node);
+	Strat::checkSchema(featureTypes);
+	onGenesChanged(slot);
+	initUtility(slot);
+}
+
+void StratMatrix::init(size_t first, const double* genes, size_t num, const std::vector<Strat::FeatureType>& featureTypes)
+{
+	if(first + num > size())
+		throw std::out_of_range("StratMatrix::init: wrong slots range");
+	Strat::checkSchema(featureTypes);
+	std::copy(genes, genes + (num * Strat::getGenesNum()), getGenes(first));
+	for(size_t slot = first; slot < first + num; slot++)
+	{
+		onGenesChanged(slot);
+		initUtility(slot);
 	}
 }
 
+void StratMatrix::assign(size_t slot, const StratMatrix& src)
+{
+	std::copy(src.getGenes(slot), src.getGenes(slot) + Strat::getGenesNum(), getGenes(slot));
+	updatePowers(slot);
+	_revisions[slot] = src._revisions[slot];
+	initUtility(slot);
+}
+
+void StratMatrix::assign(size_t slot, const double* genes)
+{
+	std::copy(genes, genes + Strat::getGenesNum(), getGenes(slot));
+	onGenesChanged(slot);
+	initUtility(slot);
+}
+
+void StratMatrix::born(size_t child, size_t parentA, size_t parentB)
+{
+	Strat::born(getGenes(child), getGenes(parentA), getGenes(parentB));
+	onGenesChanged(child);
+	initUtility(child);
+}
+
 constexpr std::array<size_t, Strat::ACTS_COUNT> Strat::PHENOSIZES;
 
 ProjectedDataRepresentation::PointStruct Strat::getPointStruct()
@@ -248,98 +550,126 @@ ProjectedDataRepresentation::PointStruct Strat::getProbsPointStruct(size_t size)
 	return ret;
 }
 
-Strat::Strat()
+void ClanDiversity::Clan::add(const double* genes, double sign)
 {
-	initUtility();
-	for(size_t phen = 0; phen < ACTS_COUNT; phen++)
+	for(size_t g = 0; g < Strat::getGenesNum(); g++)
 	{
-		_phenotypes[phen].displ = 0.0;
-		//_phenotypes[phen].post = 0.0;
-		_phenotypes[phen].featureParams.resize(PHENOSIZES[phen]);
+		sum[g] += sign * genes[g];
+		sumSq[g] += sign * genes[g] * genes[g];
 	}
+	++updates;
 }
 
-std::pair<std::shared_ptr<Strat>, double > StratPopulation::getSphere(const std::vector<std::shared_ptr<Strat> >& clan)
+void ClanDiversity::rebuild(Clan& clan, const StratMatrix& strats, const std::vector<size_t>& members)
 {
-	 std::pair<std::shared_ptr<Strat>, double > ret(Strat::getCenter(clan), 0.0);
-	 for(auto& s : clan)
-		 ret.second = std::max(ret.second, s->dist(*ret.first));
-	 return ret;
+	clan.n = members.size();
+	clan.sum.fill(0.0);
+	clan.sumSq.fill(0.0);
+	for(auto slot : members)
+		clan.add(strats.getGenes(slot), 1.0);
+	clan.updates = 0;
 }
 
-std::shared_ptr<Strat> Strat::getCenter(const std::vector<std::shared_ptr<Strat> >& args)
+void ClanDiversity::init(const StratMatrix& strats, const std::vector<std::vector<size_t> >& clans)
 {
-	auto ret = std::make_shared<Strat>();
-	if(!args.empty())
+	_clans.assign(clans.size(), Clan());
+	_slotClans.assign(strats.size(), 0);
+	for(size_t clanNum = 0; clanNum < clans.size(); clanNum++)
 	{
-		double mul = 1.0 / static_cast<double>(args.size());
-		for(auto& a : args)
-		{
-			for(size_t phen = 0; phen < ACTS_COUNT; phen++)
-			{
-				ret->_phenotypes[phen].displ += a->_phenotypes[phen].displ * mul;
-				//_phenotypes[phen].post;
-				for(size_t feature = 0; feature < PHENOSIZES[phen]; feature++)
-				{
-					ret->_phenotypes[phen].featureParams[feature].setFactor(
-							ret->_phenotypes[phen].featureParams[feature].factor() +
-							(a->_phenotypes[phen].featureParams[feature].factor() * mul));
-					ret->_phenotypes[phen].featureParams[feature].setBend(
-							ret->_phenotypes[phen].featureParams[feature].bend() +
-							(a->_phenotypes[phen].featureParams[feature].bend() * mul));
-				}
-			}
-		}
+		for(auto slot : clans[clanNum])
+			_slotClans[slot] = static_cast<uint32_t>(clanNum);
+		rebuild(_clans[clanNum], strats, clans[clanNum]);
 	}
-	return ret;
+	snapshot(strats, clans);
 }
 
-double Strat::getNorm()const
+void ClanDiversity::replace(size_t slot, const double* oldGenes, const double* newGenes)
 {
-	double ret = 0.0;
-	double w = 0.0;
-	for(size_t phen = 0; phen < ACTS_COUNT; phen++)
+	Clan& clan = _clans[_slotClans[slot]];
+	clan.add(oldGenes, -1.0);
+	clan.add(newGenes, 1.0);
+}
+
+void ClanDiversity::exchange(size_t lhs, size_t rhs, const double* lhsGenes, const double* rhsGenes)
+{
+	Clan& lhsClan = _clans[_slotClans[lhs]];
+	Clan& rhsClan = _clans[_slotClans[rhs]];
+	if(&lhsClan == &rhsClan)
+		return;
+	lhsClan.add(lhsGenes, -1.0);
+	lhsClan.add(rhsGenes, 1.0);
+	rhsClan.add(rhsGenes, -1.0);
+	rhsClan.add(lhsGenes, 1.0);
+	std::swap(_slotClans[lhs], _slotClans[rhs]);
+}
+
+void ClanDiversity::snapshot(const StratMatrix& strats, const std::vector<std::vector<size_t> >& clans)
+{
+	for(size_t clanNum = 0; clanNum < clans.size(); clanNum++)
 	{
-		ret += pow(_phenotypes[phen].displ, 2.0);
-		w += 1.0;
-		//ret += pow(_phenotypes[phen].post, 2.0);
-		for(size_t feature = 0; feature < PHENOSIZES[phen]; feature++)
-		{
-			ret += pow(   _phenotypes[phen].featureParams[feature].factor(), 2.0);
-			ret += pow(   _phenotypes[phen].featureParams[feature].bend(), 2.0);
-			w += 2.0;
-		}
+		Clan& clan = _clans[clanNum];
+		if(clan.updates > clan.n)
+			rebuild(clan, strats, clans[clanNum]);
+		clan.center.fill(0.0);
+		clan.radius = 0.0;
+		if(!clan.n)
+			continue;
+		double mul = 1.0 / static_cast<double>(clan.n);
+		for(size_t g = 0; g < Strat::getGenesNum(); g++)
+			clan.center[g] = clan.sum[g] * mul;
+		for(auto slot : clans[clanNum])
+			clan.radius = std::max(clan.radius, Strat::dist(strats.getGenes(slot), clan.center.data()));
 	}
-	return ret / w;
 }
 
-void Strat::print(const std::string& name, std::ofstream& file) const
+double ClanDiversity::getVariance(size_t clan, size_t gene)const
 {
-	static const std::map<FeatureType, std::string> strFromFeature =
-	{
-			{FeatureType::PASSES_LN, "PASSES_LN"},
-			{FeatureType::RATING_LN, "RATING_LN"},
-			{FeatureType::TASTE_DIST, "TASTE_DIST"}
-	};
+	const Clan& c = _clans[clan];
+	if(!c.n)
+		return 0.0;
+	double mean = c.sum[gene] / static_cast<double>(c.n);
+	return std::max((c.sumSq[gene] / static_cast<double>(c.n)) - (mean * mean), 0.0);
+}
+
+ClanDiversity::Stats ClanDiversity::getStats(size_t clan)const
+{
+	Stats ret;
+	size_t n = _clans[clan].n;
+	for(size_t g = 0; g < Strat::getGenesNum(); g++)
+		ret.variance += getVariance(clan, g);
+	if(n > 1)
+		ret.pairwiseDist = std::sqrt(2.0 * ret.variance * static_cast<double>(n) / static_cast<double>(n - 1));
+	ret.radius = _clans[clan].radius;
+	return ret;
+}
+
+ClanDiversity::Stats StratPopulation::getDiversity()const
+{
+	ClanDiversity::Stats ret;
+	for(size_t clan = 0; clan < _diversity.size(); clan++)
+		ret.add(_diversity.getStats(clan));
+	if(_diversity.size())
+		ret.scale(1.0 / static_cast<double>(_diversity.size()));
+	return ret;
+}
 
+void Strat::print(const double* genes, const std::string& name, std::ofstream& file)
+{
 	file << "<" << name << ">\n";
 	for(size_t phen = 0; phen < ACTS_COUNT; phen++)
 	{
 		std::string phenName = std::string("phenotype_") + std::to_string(phen);
 		file << "<" << phenName << ">\n";
-		file << "<displ  distribution=\"constant\" val=\""<< _phenotypes[phen].displ << "\"/>\n";
+		file << "<displ  distribution=\"constant\" val=\""<< genes[getDisplIndex(phen)] << "\"/>\n";
 
 		for(size_t feature = 0; feature < PHENOSIZES[phen]; feature++)
 		{
-			const auto& iType = strFromFeature.find(_phenotypes[phen].featureParams[feature].featureType());
-			if(iType == strFromFeature.end())
-				throw std::runtime_error(std::string("Strat print: can't find feature type"));
-
-			file << "<feature_" << std::to_string(feature) <<" type=\"" << iType->second << "\">\n";
+			file << "<feature_" << std::to_string(feature) <<" type=\"" <<
+					getFeatureTypeName(Schema::getFeatureType(phen, feature)) << "\">\n";
 			file << "<factor distribution=\"constant\" val=\""<<
-					_phenotypes[phen].featureParams[feature].factor() << "\"/>\n";
+					genes[getFactorIndex(phen, feature)] << "\"/>\n";
 			file << "<bend  distribution=\"constant\" val=\"" <<
-					_phenotypes[phen].featureParams[feature].bend() << "\"/>\n";
+					genes[getBendIndex(phen, feature)] << "\"/>\n";
 
 			file << "</feature_" << std::to_string(feature) << ">\n";
 		}
@@ -349,108 +679,194 @@ void Strat::print(const std::string& name, std::ofstream& file) const
 	file << "</" << name << ">\n";
 }
 
-double Strat::dist(const Strat& rhs)const
+const std::string& Strat::getFeatureTypeName(FeatureType featureType)
 {
-	double ret = 0.0;
-	for(size_t phen = 0; phen < ACTS_COUNT; phen++)
+	static const std::map<FeatureType, std::string> strFromFeature =
 	{
-		ret += pow(_phenotypes[phen].displ - rhs._phenotypes[phen].displ, 2.0);
+			{FeatureType::PASSES_LN, "PASSES_LN"},
+			{FeatureType::RATING_LN, "RATING_LN"},
+			{FeatureType::TASTE_DIST, "TASTE_DIST"}
+	};
+	const auto& iType = strFromFeature.find(featureType);
+	if(iType == strFromFeature.end())
+		throw std::runtime_error(std::string("Strat::getFeatureTypeName: can't find feature type"));
+	return iType->second;
+}
+
+Strat::FeatureType Strat::getFeatureType(const std::string& name)
+{
+	for(size_t t = 0; t < static_cast<size_t>(FeatureType::UNDEF); t++)
+		if(getFeatureTypeName(static_cast<FeatureType>(t)) == name)
+			return static_cast<FeatureType>(t);
+	throw std::runtime_error(std::string("Strat::getFeatureType: can't find feature type <") + name + ">");
+}
+
+std::vector<Strat::FeatureType> Strat::getSchemaFeatureTypes()
+{
+	std::vector<FeatureType> ret;
+	for(size_t phen = 0; phen < ACTS_COUNT; phen++)
 		for(size_t feature = 0; feature < PHENOSIZES[phen]; feature++)
-		{
-			ret += pow(   _phenotypes[phen].featureParams[feature].factor()
-					- rhs._phenotypes[phen].featureParams[feature].factor(), 2.0);
-			ret += pow(   _phenotypes[phen].featureParams[feature].bend()
-					- rhs._phenotypes[phen].featureParams[feature].bend(), 2.0);
-		}
+			ret.push_back(Schema::getFeatureType(phen, feature));
+	return ret;
+}
+
+std::string Strat::getSchemaName(const std::vector<FeatureType>& featureTypes)
+{
+	std::string ret;
+	auto iType = featureTypes.begin();
+	for(size_t phen = 0; phen < ACTS_COUNT; phen++)
+	{
+		if(phen)
+			ret += ";";
+		for(size_t feature = 0; (feature < PHENOSIZES[phen]) && (iType != featureTypes.end()); feature++)
+			ret += std::string(feature ? "," : "") + ((*iType < FeatureType::UNDEF) ? getFeatureTypeName(*(iType++)) : "?");
 	}
+	return ret;
+}
+
+void Strat::checkSchema(const std::vector<FeatureType>& featureTypes)
+{
+	static const std::vector<FeatureType> compiled = getSchemaFeatureTypes();
+	if(featureTypes != compiled)
+		throw std::runtime_error(std::string("Strat::checkSchema: features <") + getSchemaName(featureTypes) +
+				"> don't match compiled schema <" + getSchemaName(compiled) + ">");
+}
+
+double Strat::dist(const double* lhs, const double* rhs)
+{
+	double ret = 0.0;
+	for(size_t g = 0; g < getGenesNum(); g++)
+		ret += pow(lhs[g] - rhs[g], 2.0);
 	return sqrt(ret);
 }
 
-void Strat::sendTo(std::unique_ptr<ProjectedDataRepresentation>& representation, size_t color) const
+void Strat::sendTo(const double* genes, std::unique_ptr<ProjectedDataRepresentation>& representation, size_t color)
 {
 	for(size_t phen = 0; phen < ACTS_COUNT; phen++)
 	{
 		std::string phenName = std::string("phen") + std::to_string(phen);
-		representation->set(phenName, {_phenotypes[phen].displ, static_cast<double>(color)});
+		representation->set(phenName, {genes[getDisplIndex(phen)], static_cast<double>(color)});
 
 		for(size_t feature = 0; feature < PHENOSIZES[phen]; feature++)
 			representation->set(phenName + ".f" + std::to_string(feature),{
-					_phenotypes[phen].featureParams[feature].factor(),
-					_phenotypes[phen].featureParams[feature].bend()
+					genes[getFactorIndex(phen, feature)],
+					genes[getBendIndex(phen, feature)]
 					,static_cast<double>(color)
 					});
 	}
 }
 
-double Strat::FeatureParams::calcPower(double bend)
+double Strat::calcPower(double bend)
 {
 	static constexpr double ln05 = log(0.5);
 	return ln05 / log(sigmoid(-bend));
 };
 
-double StratPopulation::getAvgProb(std::vector<Strat::Feature> features, Strat::ActType actType)const
+void StratMatrix::getAvgProbs(Strat::ActType actType, const std::vector<double>& points, std::vector<double>& probs)const
 {
-	double sumP = 0.0;
-	double sumW = 0.0;
-	for(auto& clan : _strats)
-		for(auto& g : clan)
+	size_t actTypeNum = static_cast<size_t>(actType);
+	if(actTypeNum >= Strat::ACTS_COUNT)
+		throw std::logic_error("StratMatrix::getAvgProbs: wrong act type");
+	size_t phenosize = Strat::PHENOSIZES[actTypeNum];
+	if(points.size() % phenosize)
+		throw std::logic_error("StratMatrix::getAvgProbs: wrong size of points");
+	size_t pointsNum = points.size() / phenosize;
+	size_t stratsNum = size();
+	probs.assign(pointsNum, 0.0);
+	if(!stratsNum)
+		return;
+
+	//столбцы фенотипа: displ, затем factor и power по признакам
+	std::vector<double> columns(stratsNum * (1 + (2 * phenosize)));
+	double* displ = columns.data();
+	double* factors = displ + stratsNum;
+	double* powers = factors + (stratsNum * phenosize);
+	for(size_t slot = 0; slot < stratsNum; slot++)
+	{
+		const double* genes = getGenes(slot);
+		const double* slotPowers = getPowers(slot);
+		displ[slot] = genes[Strat::getDisplIndex(actTypeNum)];
+		for(size_t f = 0; f < phenosize; f++)
 		{
-			double curW = 1.0;//std::max(g->getObservation(false), 0.0);
-			sumW += curW;
-			sumP += curW * g->get(features, actType, true);
+			factors[(f * stratsNum) + slot] = genes[Strat::getFactorIndex(actTypeNum, f)];
+			powers[(f * stratsNum) + slot] = slotPowers[Strat::getFeatureIndex(actTypeNum, f)];
+		}
+	}
 
+	std::vector<double> acc(stratsNum);
+	for(size_t point = 0; point < pointsNum; point++)
+	{
+		std::copy(displ, displ + stratsNum, acc.begin());
+		for(size_t f = 0; f < phenosize; f++)
+		{
+			double x = std::max(std::min(points[(point * phenosize) + f], 1.0), 0.0);
+			if(x <= 0.0)
+				continue;//0^power = 0, степени положительны
+			double lnX = std::log(x);
+			const double* curFactors = factors + (f * stratsNum);
+			const double* curPowers = powers + (f * stratsNum);
+			for(size_t slot = 0; slot < stratsNum; slot++)
+				acc[slot] += curFactors[slot] * VecMath::powFromLog(lnX, curPowers[slot]);
 		}
-	return (sumW > 0.0) ? sumP / sumW : 0.0;
+		double sum = 0.0;
+		for(size_t slot = 0; slot < stratsNum; slot++)
+			sum += VecMath::sigmoid(acc[slot]);
+		probs[point] = sum / static_cast<double>(stratsNum);
+	}
 }
 
 void StratPopulation::updateProbsRepresentation(std::unique_ptr<ProjectedDataRepresentation>& representation)const
 {
 	bool heatmap = Settings::attribute("display.probs", "heatmap").as_bool();
 	size_t pointsNum = Settings::attribute("display.probs", "pointsNum").as_uint();
+	std::vector<double> points;
+	std::vector<double> probs;
 
 	for(size_t phen = 0; phen < Strat::ACTS_COUNT; phen++)
 	{
-		std::vector<Strat::Feature> features(Strat::PHENOSIZES[phen]);
+		size_t phenosize = Strat::PHENOSIZES[phen];
+		auto actType = static_cast<Strat::ActType>(phen);
 
-		if(heatmap && (Strat::PHENOSIZES[phen] > 1))
+		if(heatmap && (phenosize > 1))
 		{
-			for(size_t featureX = 0; featureX < Strat::PHENOSIZES[phen]; featureX++)
-				for(size_t featureY = (featureX + 1); featureY < Strat::PHENOSIZES[phen]; featureY++)
+			for(size_t featureX = 0; featureX < phenosize; featureX++)
+				for(size_t featureY = (featureX + 1); featureY < phenosize; featureY++)
 				{
-					for(auto& f : features)
-						f.set(0.5);
-
-					representation->startSending();
+					points.assign(pointsNum * pointsNum * phenosize, 0.5);
 					for(size_t i = 0; i < pointsNum; i++)
 						for(size_t j = 0; j < pointsNum; j++)
 						{
-							double valX = static_cast<double>(i) / static_cast<double>(pointsNum - 1);
-							double valY = static_cast<double>(j) / static_cast<double>(pointsNum - 1);
-							features[featureX].set(valX);
-							features[featureY].set(valY);
-							double prob = getAvgProb(features, static_cast<Strat::ActType>(phen));
-							representation->set(
-									Strat::getProbsProjName(_populationNum, phen, {featureX, featureY})
-							,
-									{valX, valY, prob});
-							representation->next();
+							size_t point = (i * pointsNum) + j;
+							points[(point * phenosize) + featureX] = static_cast<double>(i) / static_cast<double>(pointsNum - 1);
+							points[(point * phenosize) + featureY] = static_cast<double>(j) / static_cast<double>(pointsNum - 1);
 						}
+					_strats.getAvgProbs(actType, points, probs);
+
+					representation->startSending();
+					for(size_t point = 0; point < probs.size(); point++)
+					{
+						representation->set(
+								Strat::getProbsProjName(_populationNum, phen, {featureX, featureY})
+						,
+								{points[(point * phenosize) + featureX], points[(point * phenosize) + featureY], probs[point]});
+						representation->next();
+					}
 				}
 		}
 		else
 		{
 
-			for(size_t feature = 0; feature < Strat::PHENOSIZES[phen]; feature++)
+			for(size_t feature = 0; feature < phenosize; feature++)
 			{
-				for(auto& f : features)
-					f.set(0.5);
+				points.assign(pointsNum * phenosize, 0.5);
+				for(size_t i = 0; i < pointsNum; i++)
+					points[(i * phenosize) + feature] = static_cast<double>(i) / static_cast<double>(pointsNum - 1);
+				_strats.getAvgProbs(actType, points, probs);
+
 				representation->startSending();
 				for(size_t i = 0; i < pointsNum; i++)
 				{
-					double val = static_cast<double>(i) / static_cast<double>(pointsNum - 1);
-					features[feature].set(val);
-					double prob = getAvgProb(features, static_cast<Strat::ActType>(phen));
-					representation->set( Strat::getProbsProjName(_populationNum, phen, {feature}),{val, prob});
+					representation->set( Strat::getProbsProjName(_populationNum, phen, {feature}),{points[(i * phenosize) + feature], probs[i]});
 					representation->next();
 				}
 			}
@@ -458,84 +874,37 @@ void StratPopulation::updateProbsRepresentation(std::unique_ptr<ProjectedDataRep
 	}
 }
 
-void Strat::init(const pugi::xml_node& node)
+void Strat::init(double* genes, FeatureType* featureTypes, const pugi::xml_node& node)
 {
-	initUtility();
-	static const std::map<std::string, FeatureType> featureFromStr =
-	{
-		{"PASSES_LN", FeatureType::PASSES_LN},
-		{"RATING_LN",     FeatureType::RATING_LN},
-		{"TASTE_DIST",     FeatureType::TASTE_DIST}
-	};//бррр... %(
-
 	size_t i = 0;
 	Xml::NodesList phenotypeNodes(node, "phenotype_");
 	while(!phenotypeNodes.finished())
 	{
 		if(i >= ACTS_COUNT)
-			throw std::runtime_error(std::string("Strat constructor: phenotypes list overflow"));
-		_phenotypes[i].displ = Settings::getRnd(Xml::getNode(phenotypeNodes.get(), "displ"));
+			throw std::runtime_error(std::string("Strat::init: phenotypes list overflow"));
+		genes[getDisplIndex(i)] = Settings::getRnd(Xml::getNode(phenotypeNodes.get(), "displ"));
 		size_t j = 0;
 		Xml::NodesList featureNodes(phenotypeNodes.get(), "feature_");
 		while(!featureNodes.finished())
 		{
 			if(j >= PHENOSIZES[i])
-				throw std::runtime_error(std::string("Strat constructor: features list overflow"));
-			std::string typeStr = Xml::getAttribute(featureNodes.get(), "type").as_string();
-			const auto& iType = featureFromStr.find(typeStr);
-			if(iType == featureFromStr.end())
-				throw std::runtime_error(std::string("Strat constructor: can't find feature type <") + typeStr + ">");
-			_phenotypes[i].featureParams.emplace_back(FeatureParams(iType->second,
-						Settings::getRnd(Xml::getNode(featureNodes.get(), "factor")),
-						Settings::getRnd(Xml::getNode(featureNodes.get(), "bend"))));
+				throw std::runtime_error(std::string("Strat::init: features list overflow"));
+			featureTypes[getFeatureIndex(i, j)] = getFeatureType(Xml::getAttribute(featureNodes.get(), "type").as_string());
+			genes[getFactorIndex(i, j)] = Settings::getRnd(Xml::getNode(featureNodes.get(), "factor"));
+			genes[getBendIndex(i, j)] = Settings::getRnd(Xml::getNode(featureNodes.get(), "bend"));
 			featureNodes.next();
 			++j;
 		}
 		if(j != PHENOSIZES[i])
-			throw std::runtime_error(std::string("Strat constructor: features is not enough"));
+			throw std::runtime_error(std::string("Strat::init: features is not enough"));
 		phenotypeNodes.next();
 		++i;
 	}
 	if(i != ACTS_COUNT)
-		throw std::runtime_error(std::string("Strat constructor: phenotypes is not enough"));
-
-}
-
-Strat::Strat(const pugi::xml_node& node)
-{
-	init(node);
-}
+		throw std::runtime_error(std::string("Strat::init: phenotypes is not enough"));
 
-Strat::Strat(const std::string& initAttrName) : _initAttrName(initAttrName)
-{
-	pugi::xml_node node = Settings::getNode(initAttrName);
-	init(node);
 }
 
-double Strat::get(const std::vector<Feature>& features, ActType actType, bool disableFeatureTypeCheck) const
-{
-	size_t actTypeNum = static_cast<size_t>(actType);
-	if(actTypeNum >= ACTS_COUNT)
-		throw std::logic_error("Strat::getProb: wrong act type");
-
-	size_t phenosize = PHENOSIZES[actTypeNum];
-	auto& curPhenotypes =  _phenotypes[actTypeNum];
-
-	if(curPhenotypes.featureParams.size() != phenosize)
-		throw std::logic_error("Strat::getProb: wrong size of phenotypes");
-	if(features.size() != phenosize)
-		throw std::logic_error("Strat::getProb: wrong size of features vector");
-	double ret = curPhenotypes.displ;
-	for(size_t i = 0; i < phenosize; i++)
-	{
-		if(!disableFeatureTypeCheck && !features[i].checkType(curPhenotypes.featureParams[i]._featureType))
-			throw std::logic_error("Strat::getProb: wrong feature type");
-		ret += pow(features[i].get(), curPhenotypes.featureParams[i].power()) * curPhenotypes.featureParams[i].factor();
-	}
-
-	return  activation(ret);//>0
-};
-
 double Strat::mix(double lhs, double rhs, bool pnx)
 {
 	double limit = Settings::get("strat.breed", "limit");
@@ -552,44 +921,50 @@ double Strat::mix(double lhs, double rhs, bool pnx)
 	}
 }
 
-void Strat::born(const Strat& parentA, const Strat& parentB)
+void Strat::born(double* child, const double* parentA, const double* parentB)
 {
 	bool pnx = (Rnd::uniform() < Settings::get("strat.breed", "pnxProb"));
-	for(size_t phen = 0; phen < ACTS_COUNT; phen++)
-	{
-		_phenotypes[phen].displ = mix(parentA._phenotypes[phen].displ, parentB._phenotypes[phen].displ, pnx);
-
-		for(size_t i = 0; i < PHENOSIZES[phen]; i++)
-		{
-			_phenotypes[phen].featureParams[i].setFactor(mix(
-						parentA._phenotypes[phen].featureParams[i].factor(),
-						parentB._phenotypes[phen].featureParams[i].factor(), pnx));
+	for(size_t g = 0; g < getGenesNum(); g++)
+		child[g] = mix(parentA[g], parentB[g], pnx);
+}
 
-			_phenotypes[phen].featureParams[i].setBend(mix(
-						parentA._phenotypes[phen].featureParams[i].bend(),
-						parentB._phenotypes[phen].featureParams[i].bend(), pnx));
-		}
+double User::getFeature(Strat::FeatureType featureType, const Article& article)const
+{
+	double ret = 0.0;
+	switch(featureType)
+	{
+	case Strat::FeatureType::PASSES_LN:
+		ret = s_articlePassesLnFactor * StratMath::log((1.0 + static_cast<double>(article.getPasses())));
+		break;
+	case Strat::FeatureType::RATING_LN:
+		ret = s_articleRatingLnFactor * StratMath::log((1.0 + article.getRating()));
+		break;
+	case Strat::FeatureType::TASTE_DIST:
+		ret = _taste.dist(article.getProperties());
+		break;
+	default:
+		throw std::logic_error("User::getFeature: unknown feature type");
 	}
-	initUtility();
+	return std::max(std::min(ret, 1.0), 0.0);
+}
+
+//типы признаков - константы схемы, после подстановки switch в getFeature сворачивается
+template<Strat::ActType actType>
+Strat::Features<actType> User::getFeatures(const Article& article)const
+{
+	Strat::Features<actType> ret;
+	for(size_t i = 0; i < ret.size(); i++)
+		ret[i] = getFeature(Strat::Schema::getFeatureType(static_cast<size_t>(actType), i), article);
+	return ret;
 }
 
 double User::getVoteWeight(const std::shared_ptr<Article>& article)
 {
-	double dist = _taste.dist(article->getProperties());
 	double ret = 0.0;
 	if(static_cast<bool>(_strat))
-	{
-		std::vector<Strat::Feature> features =
-		{
-			Strat::Feature(Strat::FeatureType::TASTE_DIST),
-			Strat::Feature(Strat::FeatureType::RATING_LN)
-		};
-		features[0].set(dist);
-		features[1].set(s_articleRatingLnFactor * log((1.0 + article->getRating())));
-		ret = std::min(_strat->get(features, Strat::ActType::BET_WEIGHT), _charge);
-	}
+		ret = std::min(_strat.get<Strat::ActType::BET_WEIGHT>(getFeatures<Strat::ActType::BET_WEIGHT>(*article)), _charge);
 	else
-		ret = pow(1.0 - dist, s_straightforwardFactorPower);
+		ret = pow(1.0 - _taste.dist(article->getProperties()), s_straightforwardFactorPower);
 
 	_charge -= ret;
 	return ret;
@@ -603,18 +978,10 @@ std::shared_ptr<Article> User::pickArticle(std::vector<std::shared_ptr<Article>
 		if(buf.size() != articles.size())
 			throw std::logic_error("User::pickArticle buf.size() != articles.size()");
 
-		std::vector<Strat::Feature> features =
-		{
-			Strat::Feature(Strat::FeatureType::PASSES_LN),
-			Strat::Feature(Strat::FeatureType::RATING_LN)
-		};
-
 		double sumW = 0.0;
 		for(size_t i = 0; i < articles.size(); i++)
 		{
-			features[0].set(s_articlePassesLnFactor * log((1.0 + static_cast<double>(articles[i]->getPasses()))));
-			features[1].set(s_articleRatingLnFactor * log((1.0 + articles[i]->getRating())));
-			double curW = _strat->get(features, Strat::ActType::PICK_WEIGHT);
+			double curW = _strat.get<Strat::ActType::PICK_WEIGHT>(getFeatures<Strat::ActType::PICK_WEIGHT>(*articles[i]));
 			buf[i] = curW;
 			sumW += curW;
 		}
@@ -622,7 +989,11 @@ std::shared_ptr<Article> User::pickArticle(std::vector<std::shared_ptr<Article>
 			for(auto& w : buf)
 				w /= sumW;
 
-		double rnd = Rnd::uniform();
+		double rnd = 0.0;
+		{
+			Rnd::StreamScope scope(getScenarioStream());
+			rnd = Rnd::uniform();
+		}
 		sumW = 0.0;
 		for(size_t i = 0; i < articles.size(); i++)
 		{
@@ -666,7 +1037,7 @@ void User::startPass(StratEnvironment& strats, const Rules& rules, const GlobalP
 	if(((_curPass++) >= s_maxPasses) || (_charge < 0.001))
 	{
 		if(static_cast<bool>(_strat))
-			_strat->pushObservatedUtility(getTotalUtility(globalProps) / _stack->get());
+			_strat.pushObservatedUtility(getTotalUtility(globalProps) / _stack->get());
 		_charge = s_initCharge;
 		_stack->init();
 		_taste.init();
@@ -675,8 +1046,17 @@ void User::startPass(StratEnvironment& strats, const Rules& rules, const GlobalP
 		_votes.clear();
 
 		bool straightforward = (Rnd::uniform() < rules.getStraightforwardProb());
-		_strat = straightforward ? std::shared_ptr<Strat>() : strats.pick(_stack->get(), 0.5);
-		_stack->setExternalValue(strats.fixStackSize(_stack->get()));
+		size_t stackGroup = strats.getStackGroup(_stack->get());
+		_strat = straightforward ? StratRef() : strats.pick(stackGroup, 0.5);
+		_stack->setExternalValue(strats.getStackFloor(stackGroup));
+		//стек внутри группы уже одинаковый, из сценария клана перетягиваются вкус и выбор статей;
+		//статьи и другие пользователи общие для всего рынка и остаются в основном потоке
+		if(std::mt19937* stream = getScenarioStream())
+		{
+			stream->seed(static_cast<unsigned>(_strat.scenario ^ (_strat.scenario >> 32)));
+			Rnd::StreamScope scope(stream);
+			_taste.init();
+		}
 	}
 }
 
@@ -849,232 +1229,1193 @@ Rules::Rules(const std::string& path) :
 
 
 //////////////////////////////////////////
-std::shared_ptr<Strat>& StratPopulation::pick()
+void StratPopulation::initIterations()
 {
-	if((_index.first < _strats.size()) && (_index.second >= _strats[_index.first].size()))
+	_index.first = _clans.size();
+	_index.second = 0;
+	_iteration = 0;
+	_diversity.init(_strats, _clans);
+	uint64_t hi = Rnd::engine()();
+	_keySeed = (hi << 32) | Rnd::engine()();
+}
+
+size_t StratPopulation::pick(uint64_t& scenario, size_t& cycle)
+{
+	std::unique_lock<std::mutex> lock(_pickMutex);
+	if((_index.first < _clans.size()) && (_index.second >= _clans[_index.first].size()))
 	{
 		++_index.first;
 		_index.second = 0;
 	}
-	if(_index.first >= _strats.size())
+	if(_index.first >= _clans.size())
 	{
-		++_iteration;
-		if(_iteration > s_iterSize)
+		if(_deferEvolution)
+			++_deferredCycles;
+		else
 		{
-			evolutionStep();
-			_iteration = 0;
+			++_iteration;
+			evolve();
 		}
-		for(auto& clan : _strats)
-			std::random_shuffle(clan.begin(), clan.end());
 		_index.first = 0;
 		_index.second = 0;
+		if((++_cycle > SCENARIO_LAG) && s_scenarioTracking)
+			foldScenarios(_cycle - SCENARIO_LAG);
+		//порядок обхода кланов - перестановка по ключу цикла, сами кланы не переставляются
+		_sweepKey = Rnd::hash(_keySeed ^ Rnd::hash(2 * static_cast<uint64_t>(_cycle)));
+		if(s_commonScenarios)
+			_scenarioBase = Rnd::hash(_keySeed ^ Rnd::hash((2 * static_cast<uint64_t>(_cycle)) + 1));
 	}
-	return _strats[_index.first][_index.second++];
+	//без общих сценариев номер нужен только для сравнения разброса по блокам (population.crn track)
+	cycle = _cycle;
+	scenario = 0;
+	if(s_scenarioTracking)
+	{
+		size_t block = s_scenarioBlock ? (_index.second / s_scenarioBlock) : 0;
+		scenario = Rnd::hash(_scenarioBase ^ Rnd::hash((static_cast<uint64_t>(_cycle) << 40) ^
+				(static_cast<uint64_t>(_index.first) << 24) ^ block)) | 1;
+	}
+	const auto& clan = _clans[_index.first];
+	return clan[Permutation(clan.size(), Rnd::hash(_sweepKey ^ _index.first))(_index.second++)];
 }
 
-void StratPopulation::sendTo(std::unique_ptr<ProjectedDataRepresentation>& representation, size_t color) const
+void StratPopulation::observe(size_t slot, double val, uint64_t scenario, size_t cycle)
 {
-	for(auto& clan : _strats)
-		for(auto& strat : clan)
-		{
-			strat->sendTo(representation, color);
-			representation->next();
-		}
+	_strats.pushObservatedUtility(slot, val);
+	if(_archive)
+		_archive.push(_archive.getKey(_strats, slot), val, _cycle);
+	//блок сценария старше SCENARIO_LAG циклов уже свернут: запоздавшее наблюдение не открывает
+	//второй блок того же сценария и в разброс не входит
+	if(!s_scenarioTracking || (cycle + SCENARIO_LAG < _cycle))
+		return;
+	auto it = _scenarioBlocks.find(scenario);
+	if(it == _scenarioBlocks.end())
+	{
+		it = _scenarioBlocks.emplace(scenario, ScenarioBlock()).first;
+		it->second.cycle = cycle;
+	}
+	it->second.add(val);
+	_scenarioTotal.add(val);
 }
 
-void StratEnvironment::sendTo(std::unique_ptr<ProjectedDataRepresentation>& representation)const
+void StratPopulation::seedFromArchive(size_t slot)
 {
-	representation->startSending();
-	for(size_t i = 0; i < _populations.size(); i++)
-		_populations[i]->sendTo(representation, i);
+	if(!_archive)
+		return;
+	++_archiveSeeds.second;
+	//меньше одного наблюдения - не оценка, новорожденная считается неоцененной
+	auto prior = _archive.get(_archive.getKey(_strats, slot), _cycle);
+	double weight = std::min(prior.first, s_archiveMaxWeight);
+	if((prior.first >= 1.0) && (weight > 0.0))
+	{
+		_strats.initUtility(slot, weight, prior.second);
+		++_archiveSeeds.first;
+	}
 }
 
-void StratEnvironment::updateProbsRepresentation(std::unique_ptr<ProjectedDataRepresentation>& representation)const
+StratSurrogate* StratPopulation::prepareSurrogate()
 {
-	for(auto& p :_populations)
-		p->updateProbsRepresentation(representation);
+	if(!s_surrogateCandidates)
+		return nullptr;
+	_surrogate.score(_strats, s_surrogateWindow);
+	double distFactor = 0.0;
+	for(size_t group = 0; group < _squelch.getGroupsNum(); group++)
+		distFactor += _squelch.getDistFactor(group);
+	distFactor /= static_cast<double>(std::max(_squelch.getGroupsNum(), static_cast<size_t>(1)));
+	_surrogate.build(_strats, distFactor);
+	if(_surrogate.empty())
+		return nullptr;
+	++_surrogateSteps.second;
+	//пока пар мало, суррогату верим
+	_surrogate.setActive((static_cast<double>(_surrogate.getScored()) < s_surrogateWindow) ||
+			(_surrogate.getCorrelation() >= s_surrogateMinCorrelation));
+	if(_surrogate.isActive())
+		++_surrogateSteps.first;
+	return &_surrogate;
 }
 
-void StratPopulation::evolutionStep()
+void StratPopulation::seedFromArchive(const std::vector<char>& reborn)
 {
-	_squelch();
-	size_t clanN = 0;
-	for(auto& clan : _strats)
-	{
-		std::sort(clan.begin(), clan.end(),[](const std::shared_ptr<Strat>& lhs, const std::shared_ptr<Strat>& rhs){
-			return lhs->getSmoothedUtility() < rhs->getSmoothedUtility();});
-
-		size_t stratsNum = clan.size();
-		size_t firstSurv = static_cast<size_t>(static_cast<double>(stratsNum) * (1.0 - s_elit));
-		for(size_t curStrat = 0; curStrat < firstSurv; curStrat++)
-			clan[curStrat]->born(*clan[Rnd::choose(firstSurv, stratsNum - 1)], *clan[Rnd::choose(firstSurv, stratsNum - 1)]);
-
-		++clanN;
-	}
-	std::vector<std::pair<std::shared_ptr<Strat>, double > > spheres;
-	for(auto& clan : _strats)
-		spheres.emplace_back(getSphere(clan));
-	for(size_t clanN = 0; clanN < _strats.size(); clanN++)
-	{
-		auto& clanA = _strats[clanN];
-		size_t clanNb = (clanN + 1) % _strats.size();
-		auto& clanB =  _strats[clanNb];
-		double clansDist = std::max((spheres[clanN].first->dist(*(spheres[clanNb].first)))
-				- (spheres[clanN].second + spheres[clanNb].second), 0.0);
-
-		double migrationProb = _migrationProb({{"d", clansDist}});
-		double migrationSize = std::ceil(static_cast<double>(std::min(clanA.size(), clanB.size())) * s_migrationRate);
-		if(Rnd::uniform() < migrationProb)
-			for(size_t m = 0; m < migrationSize; m++)
-				std::swap(clanA[Rnd::choose(0, clanA.size() - 1)], clanB[Rnd::choose(0, clanB.size() - 1)]);
-	}
+	if(!_archive)
+		return;
+	for(size_t slot = 0; slot < reborn.size(); slot++)
+		if(reborn[slot])
+			seedFromArchive(slot);
 }
 
+void StratPopulation::setGenerationLog(GenerationLog* log)
+{
+	_log = log;
+	if(!_log)
+		return;
+	_lineage.assign(_strats.size(), Lineage());
+	for(auto& l : _lineage)
+		l.id = ++_lastId;
+	_unlogged.assign(_strats.size(), 1);
+	_loggedClans.assign(_strats.size(), 0);
+	_generation = 0;
+	_logSteps = 0;
+	writeGeneration(true);
+}
 
-
-void StratEnvironment::print(std::ofstream& file)const
+void StratPopulation::registerBirth(size_t slot, GenerationLog::Origin origin, const StratOptimizer::Parents& parents)
 {
-	file << "<"  << "stratEnvironment" << ">\n";
-	for(size_t i = 0; i < _populations.size(); i++)
-		_populations[i]->print(std::string("population_") +  std::to_string(i), file);
-	file << "</" << "stratEnvironment" << ">\n";
+	if(!_log)
+		return;
+	//родители - выжившие этого шага, их номера еще не менялись
+	auto getId = [this](size_t parent){return (parent < _lineage.size()) ? _lineage[parent].id : 0;};
+	Lineage& l = _lineage[slot];
+	l.parents = {getId(parents.first), getId(parents.second)};
+	l.id = ++_lastId;
+	l.origin = origin;
+	_unlogged[slot] = 1;
 }
 
-void Environment::save()const
+void StratPopulation::registerBirths(const std::vector<char>& reborn, const std::vector<StratOptimizer::Parents>& parents)
 {
-	std::ofstream populationsInfo;
-	populationsInfo.open (_resultFileName);
-	populationsInfo << "<?xml version=\"1.0\"?>\n";
-	_strats.print(populationsInfo);
-	populationsInfo.close();
+	if(!_log)
+		return;
+	for(size_t slot = 0; slot < reborn.size(); slot++)
+		if(reborn[slot])
+			registerBirth(slot, GenerationLog::BRED, parents[slot]);
 }
 
-#ifdef VERBOSE_MODE
-void Environment::print(std::shared_ptr<User>& user, const std::shared_ptr<Article>& article, const std::string& name)const
+void StratPopulation::logGeneration()
+{
+	if(!_log || (++_logSteps < s_historyPeriod))
+		return;
+	_logSteps = 0;
+	writeGeneration(s_historyKeyframe && ((_generation % s_historyKeyframe) == 0));
+}
+
+void StratPopulation::writeGeneration(bool keyframe)
+{
+	//в обычной записи только слоты, родившиеся после прошлой записи, и переходы между кланами
+	_log->begin(_populationNum, _generation, _cycle, _strats.size(), _clans.size(), keyframe);
+	for(size_t slot = 0; slot < _strats.size(); slot++)
+		_log->setUtility(slot, _strats.getSmoothedUtility(slot));
+	for(size_t slot = 0; slot < _strats.size(); slot++)
+		if(keyframe || _unlogged[slot])
+		{
+			const Lineage& l = _lineage[slot];
+			GenerationLog::Birth birth;
+			birth.id = l.id;
+			birth.parents = l.parents;
+			birth.slot = static_cast<uint32_t>(slot);
+			birth.origin = l.origin;
+			_log->addBirth(birth, _strats.getGenes(slot));
+			_unlogged[slot] = 0;
+		}
+	for(size_t clanNum = 0; clanNum < _clans.size(); clanNum++)
+		for(size_t slot : _clans[clanNum])
+			if(keyframe || (_loggedClans[slot] != clanNum))
+			{
+				_log->addMove(slot, clanNum);
+				_loggedClans[slot] = static_cast<uint32_t>(clanNum);
+			}
+	_log->commit();
+	++_generation;
+}
+
+void StratPopulation::foldScenarios(size_t minCycle)
+{
+	for(auto it = _scenarioBlocks.begin(); it != _scenarioBlocks.end();)
+		if(it->second.cycle < minCycle)
+		{
+			_scenarioWithin.first += it->second.getSS();
+			_scenarioWithin.second += static_cast<double>(it->second.n - 1);
+			it = _scenarioBlocks.erase(it);
+		}
+		else
+			++it;
+}
+
+StratPopulation::ScenarioVariance StratPopulation::getScenarioVariance()const
+{
+	ScenarioVariance ret;
+	ret.withinSS = _scenarioWithin.first;
+	ret.withinDf = _scenarioWithin.second;
+	for(const auto& block : _scenarioBlocks)
+	{
+		ret.withinSS += block.second.getSS();
+		ret.withinDf += static_cast<double>(block.second.n - 1);
+	}
+	ret.totalSS = _scenarioTotal.getSS();
+	ret.totalDf = _scenarioTotal.n ? static_cast<double>(_scenarioTotal.n - 1) : 0.0;
+	return ret;
+}
+
+void StratPopulation::sync()
+{
+	std::unique_lock<std::mutex> lock(_pickMutex);
+	for(; _deferredCycles; --_deferredCycles)
+	{
+		++_iteration;
+		evolve();
+	}
+}
+
+void StratPopulation::applyObservations(std::vector<Observation>& log)
+{
+	for(const auto& o : log)
+		o.population->observe(o.slot, o.val, o.scenario, o.cycle);
+	log.clear();
+}
+
+void StratPopulation::evolve()
+{
+	//мигранты с других островов принимаются вместе с новым поколением: до следующего
+	//сглаживания Squelch они успеют получить оценки
+	if(_next)
+	{
+		finishEvolution();
+		exchangeMigrants();
+		logGeneration();
+	}
+	if(s_steadyWeight > 0.0)
+	{
+		steadyStateStep();
+		if(_iteration > s_iterSize)
+		{
+			migrate(_strats, _diversity, _clans);
+			exchangeMigrants();
+			_iteration = 0;
+		}
+		logGeneration();
+	}
+	else if(_iteration > s_iterSize)
+	{
+		if(_pool)
+			startEvolution();
+		else
+		{
+			evolutionStep();
+			exchangeMigrants();
+			logGeneration();
+		}
+		_iteration = 0;
+	}
+}
+
+void StratPopulation::sendTo(std::unique_ptr<ProjectedDataRepresentation>& representation, size_t color) const
+{
+	for(auto& clan : _clans)
+		for(auto slot : clan)
+		{
+			Strat::sendTo(_strats.getGenes(slot), representation, color);
+			representation->next();
+		}
+}
+
+void StratEnvironment::sendTo(std::unique_ptr<ProjectedDataRepresentation>& representation)const
+{
+	representation->startSending();
+	for(size_t i = 0; i < _populations.size(); i++)
+		if(_populations[i])
+			_populations[i]->sendTo(representation, i);
+}
+
+void StratEnvironment::updateProbsRepresentation(std::unique_ptr<ProjectedDataRepresentation>& representation)const
+{
+	for(auto& p :_populations)
+		if(p)
+			p->updateProbsRepresentation(representation);
+}
+
+void StratPopulation::evolutionStep()
+{
+	_squelch(_strats);
+	StratSurrogate* surrogate = prepareSurrogate();
+	_reborn.assign(_strats.size(), 0);
+	_parents.resize(_strats.size());
+	for(size_t clanNum = 0; clanNum < _clans.size(); clanNum++)
+		breedClan(_strats, _diversity, _clans[clanNum], clanNum, &_reborn, &_parents, surrogate);
+	seedFromArchive(_reborn);
+	registerBirths(_reborn, _parents);
+	migrate(_strats, _diversity, _clans);
+}
+
+void StratPopulation::joinIslands(IslandChannel* channel, size_t sendRing, size_t receiveRing)
+{
+	_islands = channel;
+	_sendRing = sendRing;
+	_receiveRing = receiveRing;
+	_islandSteps = 0;
+	_migrant.resize(Strat::getGenesNum());
+	_migrantsNum = std::make_pair(0, 0);
+}
+
+void StratPopulation::exchangeMigrants()
+{
+	//поколение из пула к этому моменту уже принято, _strats можно менять
+	if(!_islands || !s_islandMigrants || (++_islandSteps < s_islandPeriod))
+		return;
+	_islandSteps = 0;
+	auto utility = [this](size_t slot){return (_strats.getWeight(slot) > 0.0) ?
+			_strats.getObservation(slot) : -std::numeric_limits<double>::infinity();};
+
+	_mature.resize(_strats.size());
+	std::iota(_mature.begin(), _mature.end(), 0);
+	size_t migrantsNum = std::min(s_islandMigrants, _mature.size());
+	std::nth_element(_mature.begin(), _mature.begin() + (migrantsNum - 1), _mature.end(),
+			[&utility](size_t lhs, size_t rhs){return utility(lhs) > utility(rhs);});
+	for(size_t i = 0; i < migrantsNum; i++)
+		if((_strats.getWeight(_mature[i]) > 0.0) && _islands->push(_sendRing, _strats.getGenes(_mature[i])))
+			++_migrantsNum.first;
+
+	//принятые заменяют неоцененных и худших
+	std::nth_element(_mature.begin(), _mature.begin() + (migrantsNum - 1), _mature.end(),
+			[&utility](size_t lhs, size_t rhs){return utility(lhs) < utility(rhs);});
+	for(size_t i = 0; (i < migrantsNum) && _islands->pop(_receiveRing, _migrant.data()); i++)
+	{
+		_diversity.replace(_mature[i], _strats.getGenes(_mature[i]), _migrant.data());
+		_strats.assign(_mature[i], _migrant.data());
+		seedFromArchive(_mature[i]);
+		registerBirth(_mature[i], GenerationLog::IMMIGRANT,
+				StratOptimizer::Parents(StratOptimizer::NO_PARENT, StratOptimizer::NO_PARENT));
+		_surrogate.forget(_mature[i]);
+		++_migrantsNum.second;
+	}
+}
+
+void StratPopulation::steadyStateStep()
+{
+	//Squelch не нужен: у созревших стратегий наблюдаемая полезность уже усреднена по весу s_steadyWeight
+	_reborn.assign(_strats.size(), 0);
+	_parents.resize(_strats.size());
+	for(size_t clanNum = 0; clanNum < _clans.size(); clanNum++)
+	{
+		_mature.clear();
+		for(size_t slot : _clans[clanNum])
+			if(_strats.getWeight(slot) >= s_steadyWeight)
+			{
+				_mature.push_back(slot);
+				_strats.setSmoothedVal(slot, _strats.getObservation(slot));
+			}
+		size_t replaceNum = std::min(s_steadyReplace,
+				static_cast<size_t>(static_cast<double>(_mature.size()) * (1.0 - s_elit)));
+		if(replaceNum && (replaceNum < _mature.size()))
+			breed(_strats, _diversity, _mature, replaceNum, clanNum, &_reborn, &_parents);
+	}
+	seedFromArchive(_reborn);
+	registerBirths(_reborn, _parents);
+}
+
+void StratPopulation::breedClan(StratMatrix& strats, ClanDiversity& diversity, std::vector<size_t>& clan, size_t clanNum,
+		std::vector<char>* reborn, std::vector<StratOptimizer::Parents>* parents, StratSurrogate* surrogate)const
+{
+	breed(strats, diversity, clan, static_cast<size_t>(static_cast<double>(clan.size()) * (1.0 - s_elit)), clanNum,
+			reborn, parents, surrogate);
+}
+
+void StratPopulation::breed(StratMatrix& strats, ClanDiversity& diversity, std::vector<size_t>& members, size_t replaceNum,
+		size_t clanNum, std::vector<char>* reborn, std::vector<StratOptimizer::Parents>* parents, StratSurrogate* surrogate)const
+{
+	auto less = [&strats](size_t lhs, size_t rhs){
+		return strats.getSmoothedUtility(lhs) < strats.getSmoothedUtility(rhs);};
+
+	//нужна только граница: слева заменяемые, справа выжившие, порядок внутри частей не важен
+	if(replaceNum < members.size())
+		std::nth_element(members.begin(), members.begin() + replaceNum, members.end(), less);
+	_optimizer->prepare(strats, members, replaceNum, clanNum);
+	//новые геномы пишутся в буфер и копируются в слоты проигравших: выжившие остаются в матрице
+	std::array<double, Strat::getGenesNum()> candidate;
+	std::array<double, Strat::getGenesNum()> best;
+	StratOptimizer::Parents candidateParents;
+	StratOptimizer::Parents bestParents;
+	for(size_t cur = 0; cur < replaceNum; cur++)
+	{
+		if(!surrogate)
+		{
+			_optimizer->sample(strats, members, replaceNum, clanNum, candidate.data(), bestParents);
+			diversity.replace(members[cur], strats.getGenes(members[cur]), candidate.data());
+			strats.assign(members[cur], candidate.data());
+		}
+		else
+		{
+			//каждый кандидат - новая выборка оптимизатора, в слот копируется лучший по предсказанию
+			size_t candidatesNum = surrogate->isActive() ? std::max(s_surrogateCandidates, static_cast<size_t>(1)) : 1;
+			double bestPrediction = -std::numeric_limits<double>::infinity();
+			for(size_t c = 0; c < candidatesNum; c++)
+			{
+				_optimizer->sample(strats, members, replaceNum, clanNum, candidate.data(), candidateParents);
+				double prediction = surrogate->predict(candidate.data());
+				if(prediction > bestPrediction)
+				{
+					bestPrediction = prediction;
+					best = candidate;
+					bestParents = candidateParents;
+				}
+			}
+			diversity.replace(members[cur], strats.getGenes(members[cur]), best.data());
+			strats.assign(members[cur], best.data());
+			surrogate->setPrediction(members[cur], bestPrediction);
+		}
+		if(reborn)
+			(*reborn)[members[cur]] = 1;
+		if(parents)
+			(*parents)[members[cur]] = bestParents;
+	}
+}
+
+void StratPopulation::migrate(const StratMatrix& strats, ClanDiversity& diversity, std::vector<std::vector<size_t> >& clans)const
+{
+	//расстояния между кланами - по центрам и радиусам до обменов
+	diversity.snapshot(strats, clans);
+	for(size_t clanN = 0; clanN < clans.size(); clanN++)
+	{
+		auto& clanA = clans[clanN];
+		size_t clanNb = (clanN + 1) % clans.size();
+		auto& clanB =  clans[clanNb];
+		double clansDist = std::max(Strat::dist(diversity.getCenter(clanN), diversity.getCenter(clanNb))
+				- (diversity.getRadius(clanN) + diversity.getRadius(clanNb)), 0.0);
+
+		double migrationProb = _migrationProb({{"d", clansDist}});
+		double migrationSize = std::ceil(static_cast<double>(std::min(clanA.size(), clanB.size())) * s_migrationRate);
+		if(Rnd::uniform() < migrationProb)
+			for(size_t m = 0; m < migrationSize; m++)
+			{
+				size_t& rhs = clanB[Rnd::choose(0, clanB.size() - 1)];
+				size_t& lhs = clanA[Rnd::choose(0, clanA.size() - 1)];
+				diversity.exchange(lhs, rhs, strats.getGenes(lhs), strats.getGenes(rhs));
+				std::swap(lhs, rhs);
+			}
+	}
+}
+
+void StratPopulation::startEvolution()
+{
+	_next = std::make_unique<Generation>();
+	_next->strats = _strats;
+	_next->clans = _clans;
+	_next->reborn.assign(_strats.size(), 0);
+	_next->parents.resize(_strats.size());
+	_next->diversity = _diversity;
+	_next->surrogate = prepareSurrogate();
+	//по зерну на каждую задачу всех фаз - из потока моделирования, по порядку
+	_next->seeds.resize(1 + _squelch.getGroupsNum() + _clans.size() + 1);
+	for(auto& seed : _next->seeds)
+		seed = static_cast<unsigned>(Rnd::engine()()) | 1;
+	runEvolutionPhase(0);
+}
+
+void StratPopulation::runEvolutionPhase(size_t phase)
+{
+	Generation& next = *_next;
+	size_t groupsNum = _squelch.getGroupsNum();
+	if((phase > 3) || next.error)
+	{
+		std::unique_lock<std::mutex> lock(next.mutex);
+		next.ready = true;
+		next.cv.notify_all();
+		return;
+	}
+	const std::array<size_t, 4> phaseSizes = {1, groupsNum, next.clans.size(), 1};
+	size_t tasksNum = phaseSizes[phase];
+	size_t firstSeed = std::accumulate(phaseSizes.begin(), phaseSizes.begin() + phase, static_cast<size_t>(0));
+	if(!tasksNum)
+	{
+		runEvolutionPhase(phase + 1);
+		return;
+	}
+	next.pending = tasksNum;
+	for(size_t task = 0; task < tasksNum; task++)
+	{
+		unsigned seed = next.seeds[firstSeed + task];
+		boost::asio::post(*_pool, [this, &next, phase, task, seed]()
+		{
+			try
+			{
+				//настройки и закэшированные параметры - thread_local, привязываем их к потоку пула
+				Settings::Scope scope(_settings);
+				StratPopulation::loadSettings();
+				Rnd::seed(seed);
+				if(phase == 0)
+					_squelch.index(next.strats);
+				else if(phase == 1)
+					_squelch(next.strats, task);
+				else if(phase == 2)
+					breedClan(next.strats, next.diversity, next.clans[task], task, &next.reborn, &next.parents, next.surrogate);
+				else
+					migrate(next.strats, next.diversity, next.clans);
+			}
+			catch(...)
+			{
+				std::unique_lock<std::mutex> lock(next.mutex);
+				if(!next.error)
+					next.error = std::current_exception();
+			}
+			if(--next.pending == 0)
+				runEvolutionPhase(phase + 1);
+		});
+	}
+}
+
+void StratPopulation::waitEvolution()
+{
+	if(!_next)
+		return;
+	std::unique_lock<std::mutex> lock(_next->mutex);
+	_next->cv.wait(lock, [this](){return _next->ready;});
+}
+
+void StratPopulation::finishEvolution()
+{
+	waitEvolution();
+	auto next = std::move(_next);
+	if(next->error)
+		std::rethrow_exception(next->error);
+	//оценки выживших накоплены на текущем поколении, у новорожденных сброшены;
+	//сглаженные полезности выживших посчитаны на копии и переносятся, как при синхронной эволюции
+	for(size_t slot = 0; slot < _strats.size(); slot++)
+		if(next->reborn[slot])
+		{
+			_strats.assign(slot, next->strats);
+			seedFromArchive(slot);
+			registerBirth(slot, GenerationLog::BRED, next->parents[slot]);
+		}
+		else
+			_strats.setSmoothedVal(slot, next->strats.getSmoothedUtility(slot));
+	_clans.swap(next->clans);
+	std::swap(_diversity, next->diversity);
+}
+
+StratPopulation::~StratPopulation()
+{
+	waitEvolution();
+}
+
+
+
+void StratEnvironment::snapshot(PopulationArchive::Layout& layout, std::vector<double>& genes)const
+{
+	layout.phenosizes.assign(Strat::PHENOSIZES.begin(), Strat::PHENOSIZES.end());
+	layout.clans.clear();
+	genes.clear();
+	for(size_t i = 0; i < _populations.size(); i++)
+		if(_populations[i])
+			_populations[i]->write(layout, genes);
+		else
+			layout.clans.emplace_back();//группа без пользователей
+
+	layout.featureTypes.clear();
+	for(auto t : Strat::getSchemaFeatureTypes())
+		layout.featureTypes.push_back(static_cast<uint32_t>(t));
+}
+
+std::pair<double, double> StratPopulation::getUtilitySum()const
+{
+	std::pair<double, double> ret(0.0, 0.0);
+	for(size_t slot = 0; slot < _strats.size(); slot++)
+		if(_strats.getWeight(slot) > 0)
+		{
+			ret.first += _strats.getObservation(slot);
+			ret.second += 1.0;
+		}
+	return ret;
+}
+
+Squelch<StratMatrix>::FitOptions StratPopulation::getFitOptions()
+{
+	Squelch<StratMatrix>::FitOptions ret;
+	if(Settings::exist("squelch.fit", "xtolRel"))
+		ret.xtolRel = Settings::get("squelch.fit", "xtolRel");
+	if(Settings::exist("squelch.fit", "ftolRel"))
+		ret.ftolRel = Settings::get("squelch.fit", "ftolRel");
+	if(Settings::exist("squelch.fit", "maxEval"))
+		ret.maxEval = Settings::attribute("squelch.fit", "maxEval").as_uint();
+	if(Settings::exist("squelch.fit", "gradient"))
+		ret.gradient = Settings::attribute("squelch.fit", "gradient").as_bool();
+	return ret;
+}
+
+Squelch<StratMatrix>::FitStats StratPopulation::getFitStats()
+{
+	waitEvolution();
+	return _squelch.getFitStats();
+}
+
+void StratEnvironment::setup(size_t group, StratPopulation& population)const
+{
+	size_t populationsNum = _populations.size();
+	population.setDeferEvolution(_deferEvolution);
+	if(_islands)
+		population.joinIslands(_islands, (((_islandIndex.second + 1) % _islandIndex.first) * populationsNum) + group,
+				(_islandIndex.second * populationsNum) + group);
+	if(_log)
+		population.setGenerationLog(_log);
+}
+
+StratPopulation* StratEnvironment::create(size_t group)
+{
+	std::unique_lock<std::mutex> lock(_createMutex);
+	StratPopulation* ret = _active[group].load(std::memory_order_relaxed);
+	if(ret)
+		return ret;
+	auto population = std::make_unique<StratPopulation>(group, _pool.get());
+	initFresh(group, *population);
+	setup(group, *population);
+	ret = population.get();
+	_populations[group] = std::move(population);
+	_active[group].store(ret, std::memory_order_release);
+	return ret;
+}
+
+void StratEnvironment::initFresh(size_t group, StratPopulation& population)const
+{
+	//начальные стратегии не зависят от того, какая реплика и когда пришла в группу
+	std::mt19937 stream(static_cast<unsigned>(Rnd::hash(_lazySeed ^ group)));
+	Rnd::StreamScope scope(&stream);
+	population.init("strat.init");
+}
+
+size_t StratEnvironment::getActiveNum()const
+{
+	return static_cast<size_t>(std::count_if(_populations.begin(), _populations.end(),
+			[](const std::unique_ptr<StratPopulation>& p){return static_cast<bool>(p);}));
+}
+
+void StratEnvironment::joinIslands(IslandChannel* channel, size_t islandsNum, size_t island)
+{
+	_islands = channel;
+	_islandIndex = std::make_pair(islandsNum, island);
+	size_t populationsNum = _populations.size();
+	for(size_t p = 0; p < populationsNum; p++)
+		if(_populations[p])
+			_populations[p]->joinIslands(channel, (((island + 1) % islandsNum) * populationsNum) + p,
+					(island * populationsNum) + p);
+}
+
+void StratEnvironment::setGenerationLog(GenerationLog* log)
+{
+	_log = log;
+	for(auto& p : _populations)
+		if(p)
+			p->setGenerationLog(log);
+}
+
+void StratEnvironment::setDeferEvolution(bool defer)
+{
+	_deferEvolution = defer;
+	for(auto& p : _populations)
+		if(p)
+			p->setDeferEvolution(defer);
+}
+
+void StratEnvironment::sync()
+{
+	for(auto& p : _populations)
+		if(p)
+			p->sync();
+}
+
+std::pair<size_t, size_t> StratEnvironment::getMigrantsNum()const
+{
+	std::pair<size_t, size_t> ret(0, 0);
+	for(auto& p : _populations)
+	{
+		if(!p)
+			continue;
+		auto cur = p->getMigrantsNum();
+		ret.first += cur.first;
+		ret.second += cur.second;
+	}
+	return ret;
+}
+
+std::array<double, 4> StratEnvironment::getSurrogateStats()const
+{
+	std::array<double, 4> ret = {0.0, 0.0, 0.0, 0.0};
+	double scored = 0.0;
+	for(auto& p : _populations)
+	{
+		if(!p)
+			continue;
+		auto steps = p->getSurrogateSteps();
+		ret[0] += static_cast<double>(steps.first);
+		ret[1] += static_cast<double>(steps.second);
+		const auto& surrogate = p->getSurrogate();
+		if(surrogate.getSamples() > 0.0)
+		{
+			ret[2] += surrogate.getCorrelation();
+			ret[3] += surrogate.getRmse();
+			scored += 1.0;
+		}
+	}
+	if(scored > 0.0)
+	{
+		ret[2] /= scored;
+		ret[3] /= scored;
+	}
+	return ret;
+}
+
+std::pair<size_t, size_t> StratEnvironment::getArchiveSeeds()const
+{
+	std::pair<size_t, size_t> ret(0, 0);
+	for(auto& p : _populations)
+	{
+		if(!p)
+			continue;
+		auto cur = p->getArchiveSeeds();
+		ret.first += cur.first;
+		ret.second += cur.second;
+	}
+	return ret;
+}
+
+ClanDiversity::Stats StratEnvironment::getDiversity()const
+{
+	ClanDiversity::Stats ret;
+	for(auto& p : _populations)
+		if(p)
+			ret.add(p->getDiversity());
+	if(size_t activeNum = getActiveNum())
+		ret.scale(1.0 / static_cast<double>(activeNum));
+	return ret;
+}
+
+StratPopulation::ScenarioVariance StratEnvironment::getScenarioVariance()const
+{
+	StratPopulation::ScenarioVariance ret;
+	for(auto& p : _populations)
+		if(p)
+			ret.add(p->getScenarioVariance());
+	return ret;
+}
+
+Squelch<StratMatrix>::FitStats StratEnvironment::getFitStats()
+{
+	Squelch<StratMatrix>::FitStats ret;
+	for(auto& p : _populations)
+		if(p)
+			ret.add(p->getFitStats());
+	return ret;
+}
+
+double StratEnvironment::getMeanUtility()const
+{
+	std::pair<double, double> sum(0.0, 0.0);
+	for(auto& p : _populations)
+	{
+		if(!p)
+			continue;
+		auto cur = p->getUtilitySum();
+		sum.first += cur.first;
+		sum.second += cur.second;
+	}
+	return (sum.second > 0.0) ? sum.first / sum.second : 0.0;
+}
+
+std::string Environment::getSettingsFileName(const std::string& resultFileName)
+{
+	size_t dot = resultFileName.rfind('.');
+	size_t slash = resultFileName.rfind('/');
+	bool hasExt = (dot != std::string::npos) && ((slash == std::string::npos) || (dot > slash));
+	return (hasExt ? resultFileName.substr(0, dot) : resultFileName) + ".settings.xml";
+}
+
+std::string Environment::getIslandFileName(const std::string& resultFileName, size_t island)
+{
+	if(!island)
+		return resultFileName;
+	size_t dot = resultFileName.rfind('.');
+	size_t slash = resultFileName.rfind('/');
+	bool hasExt = (dot != std::string::npos) && ((slash == std::string::npos) || (dot > slash));
+	std::string suffix = std::string("_island") + std::to_string(island);
+	return hasExt ? (resultFileName.substr(0, dot) + suffix + resultFileName.substr(dot)) : (resultFileName + suffix);
+}
+
+std::string Environment::getHistoryFileName(const std::string& resultFileName)
+{
+	size_t dot = resultFileName.rfind('.');
+	size_t slash = resultFileName.rfind('/');
+	bool hasExt = (dot != std::string::npos) && ((slash == std::string::npos) || (dot > slash));
+	return (hasExt ? resultFileName.substr(0, dot) : resultFileName) + ".glog";
+}
+
+void Environment::joinIslands(const std::string& channelName, size_t islandsNum, size_t island)
+{
+	Settings::Scope settingsScope(_settings);
+	if(island >= islandsNum)
+		throw std::runtime_error("Environment::joinIslands: island >= islandsNum");
+	size_t capacity = Settings::exist("population.islands", "capacity") ?
+			Settings::attribute("population.islands", "capacity").as_uint() : 64;
+	_islands = std::make_unique<IslandChannel>(channelName, islandsNum * _strats.size(), capacity, Strat::getGenesNum());
+	_strats.joinIslands(_islands.get(), islandsNum, island);
+}
+
+void Environment::traceUtility(size_t prevPass, size_t pass, size_t period)
+{
+	if(period && ((prevPass / period) != (pass / period)))
+		_utilityTrace.push_back(TracePoint{pass, _strats.getMeanUtility(), _strats.getDiversity().pairwiseDist});
+}
+
+void Environment::addConvergenceMetrics(double tolerance)
+{
+	if(_utilityTrace.empty())
+		return;
+	//сходимость - первая точка, после которой величина не выходит
+	//из полосы tolerance вокруг последнего значения
+	auto getConverged = [this, tolerance](double TracePoint::* val)
+	{
+		double final = _utilityTrace.back().*val;
+		double band = tolerance * std::abs(final);
+		size_t ret = _utilityTrace.size() - 1;
+		while(ret && (std::abs(_utilityTrace[ret - 1].*val - final) <= band))
+			--ret;
+		return _utilityTrace[ret].pass;
+	};
+	_metrics["convergencePasses"] = static_cast<double>(getConverged(&TracePoint::utility));
+	_metrics["convergenceUtility"] = _utilityTrace.back().utility;
+	//геномы кланов перестали сжиматься
+	_metrics["diversityConvergencePasses"] = static_cast<double>(getConverged(&TracePoint::diversity));
+}
+
+void Environment::save()
+{
+	//снимок копируется в буфер, запись и переименование файла идут в фоне
+	auto startTime = std::chrono::steady_clock::now();
+	_strats.snapshot(_saveBuffer.layout, _saveBuffer.genes);
+	_saveBuffer.layout.settingsHash = std::stoull(_settings->hash(), nullptr, 16);
+	_saveBuffer.fileName = _resultFileName;
+	_saveBuffer.binary = _binaryReport;
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - startTime;
+	_saveSnapshotSeconds += elapsed.count();
+	_saveStallSeconds += _writer->submit(_saveBuffer);
+}
+
+#ifdef VERBOSE_MODE
+void Environment::print(const GlobalProps& globalProps, std::shared_ptr<User>& user, const std::shared_ptr<Article>& article, const std::string& name)const
 {
 	std::cout << "============================\n"<< name << "\n";
-	_globalProps.print();
+	globalProps.print();
 	if(static_cast<bool>(user))
-		user->print(_globalProps, "user");
+		user->print(globalProps, "user");
 	if(static_cast<bool>(article))
 		article->print("article");
 	std::cout << "\n";
 }
 #endif
 
-void Environment::run(const std::string& rulesAttrPath)
+Environment::Replica::Replica(size_t articlesNum, size_t usersNum, const std::string& rulesAttrPath) :
+		articles(articlesNum), users(usersNum), bufArticlesWeights(articlesNum),
+		rules(std::make_unique<Rules>(rulesAttrPath))
 {
-	Rules rules(rulesAttrPath);
-	size_t articlesNum = Settings::attribute("environment", "articlesNum").as_uint();
-	size_t usersNum = Settings::attribute("environment", "usersNum").as_uint();
-	size_t passesNum = Settings::attribute("environment", "passesNum").as_uint();
-	size_t displayPeriod = Settings::attribute("display", "period").as_uint();
-	size_t reportPeriod = Settings::attribute("report", "period").as_uint();
-	size_t articlesPeriod = Settings::attribute("environment", "articlesPeriod").as_uint();
-
-	std::vector<std::shared_ptr<Article> > articles(articlesNum);
 	for(auto& a : articles)
 		a = std::make_shared<Article>();
-	auto curArticle = articles.begin();
-	std::vector<std::shared_ptr<User> > users(usersNum);
 	for(auto& u : users)
 		u = std::make_shared<User>();
-	auto curUser = users.begin();
-
-	std::vector<double> bufArticlesWeights(articles.size());
-	std::chrono::milliseconds startTime = std::chrono::duration_cast< std::chrono::milliseconds >
-			(std::chrono::system_clock::now().time_since_epoch());
-
-	for(size_t pass = 0; pass < passesNum; pass++)
-	{
+}
 
-		(*curUser)->startPass(_strats, rules, _globalProps);
-		auto pickedArticle = (*curUser)->pickArticle(articles, bufArticlesWeights);
+void Environment::pass(Replica& replica, size_t pass, size_t articlesPeriod, [[maybe_unused]] size_t displayPeriod)
+{
+	Rules& rules = *replica.rules;
+	GlobalProps& globalProps = replica.globalProps;
+	auto& curUser = replica.users[replica.curUser];
+	curUser->startPass(_strats, rules, globalProps);
+	auto pickedArticle = curUser->pickArticle(replica.articles, replica.bufArticlesWeights);
 
 #ifdef VERBOSE_MODE
-		if(s_displayEnable && ((pass % displayPeriod) == 0))
-			print(*curUser, pickedArticle, "START PASS");
+	if(s_displayEnable && ((pass % displayPeriod) == 0))
+		print(globalProps, curUser, pickedArticle, "START PASS");
 #endif
-		_globalProps.rewardPool += 1.0;
-		if(static_cast<bool>(pickedArticle))
-		{
-			double prevRewardSum = pickedArticle->getRewardFuncSum();
-			double woteWeight = (*curUser)->getVoteWeight(pickedArticle);
-			pickedArticle->addVote(*curUser, woteWeight, rules);
-			double newRewardSum = pickedArticle->getRewardFuncSum();
+	globalProps.rewardPool += 1.0;
+	if(static_cast<bool>(pickedArticle))
+	{
+		double prevRewardSum = pickedArticle->getRewardFuncSum();
+		double woteWeight = curUser->getVoteWeight(pickedArticle);
+		pickedArticle->addVote(curUser, woteWeight, rules);
+		double newRewardSum = pickedArticle->getRewardFuncSum();
 
-			if(newRewardSum < prevRewardSum)
-				throw std::logic_error("newRewardSum < prevRewardSum");
+		if(newRewardSum < prevRewardSum)
+			throw std::logic_error("newRewardSum < prevRewardSum");
 
-			_globalProps.rewardFuncSum += (newRewardSum - prevRewardSum);
-		}
+		globalProps.rewardFuncSum += (newRewardSum - prevRewardSum);
+	}
 
-		if((pass % articlesPeriod) == 0)
-		{
-			_globalProps.rewardPool -= (*curArticle)->cashout(_globalProps);
-			_globalProps.rewardFuncSum -= (*curArticle)->getRewardFuncSum();
+	if((pass % articlesPeriod) == 0)
+	{
+		auto& curArticle = replica.articles[replica.curArticle];
+		globalProps.rewardPool -= curArticle->cashout(globalProps);
+		globalProps.rewardFuncSum -= curArticle->getRewardFuncSum();
 
-			(*curArticle)->init();
+		curArticle->init();
 
-			if((++curArticle) == articles.end())
-				curArticle = articles.begin();
-		}
+		if((++replica.curArticle) == replica.articles.size())
+			replica.curArticle = 0;
+	}
 
-		if((_globalProps.rewardPool < 0.0) || (_globalProps.rewardFuncSum < 0.0))
-			throw std::logic_error("((_globalProps.rewardPool < 0.0) || (_globalProps.rewardFuncSum < 0.0))");
+	if((globalProps.rewardPool < 0.0) || (globalProps.rewardFuncSum < 0.0))
+		throw std::logic_error("((_globalProps.rewardPool < 0.0) || (_globalProps.rewardFuncSum < 0.0))");
 
 
 #ifdef VERBOSE_MODE
-		if(s_displayEnable && ((pass % displayPeriod) == 0))
-			print(*curUser, pickedArticle, "FINISH PASS");
+	if(s_displayEnable && ((pass % displayPeriod) == 0))
+		print(globalProps, curUser, pickedArticle, "FINISH PASS");
 #endif
 
-		if((++curUser) == users.end())
-			curUser = users.begin();
+	if((++replica.curUser) == replica.users.size())
+		replica.curUser = 0;
+
+	for(auto& a : replica.articles)
+		a->pass();
+}
+
+void Environment::show(size_t pass, std::chrono::milliseconds startTime)
+{
+	std::cout << "pass = " << pass << "\n";
 
-		for(auto& a : articles)
-			a->pass();
+	std::chrono::milliseconds finishTime = std::chrono::duration_cast< std::chrono::milliseconds >
+			(std::chrono::system_clock::now().time_since_epoch());
+	std::cout << "time = " << (finishTime - startTime).count() << "\n";
 
-		if(s_displayEnable && ((pass % displayPeriod) == 0))
+	if(_stratRepresentation)
+	{
+		_strats.sendTo(_stratRepresentation);
+		_stratRepresentation->show();
+	}
+	if(_probsRepresentation)
+	{
+		_strats.updateProbsRepresentation(_probsRepresentation);
+		_probsRepresentation->show();
+	}
+}
+
+void Environment::run(const std::string& rulesAttrPath)
+{
+	Settings::Scope settingsScope(_settings);
+	loadSettings();
+	size_t articlesNum = Settings::attribute("environment", "articlesNum").as_uint();
+	size_t usersNum = Settings::attribute("environment", "usersNum").as_uint();
+	size_t passesNum = Settings::attribute("environment", "passesNum").as_uint();
+	size_t displayPeriod = Settings::attribute("display", "period").as_uint();
+	size_t reportPeriod = Settings::attribute("report", "period").as_uint();
+	size_t articlesPeriod = Settings::attribute("environment", "articlesPeriod").as_uint();
+	size_t replicasNum = Settings::exist("environment", "replicas") ?
+			std::max(Settings::attribute("environment", "replicas").as_uint(), 1u) : 1;
+	size_t replicaEpoch = Settings::exist("environment", "replicaEpoch") ?
+			std::max(Settings::attribute("environment", "replicaEpoch").as_uint(), 1u) : 10000;
+	size_t convergencePeriod = Settings::exist("report.convergence", "period") ?
+			Settings::attribute("report.convergence", "period").as_uint() : 0;
+	double convergenceTolerance = Settings::exist("report.convergence", "tolerance") ?
+			Settings::get("report.convergence", "tolerance") : 0.05;
+	_utilityTrace.clear();
+
+	std::vector<std::unique_ptr<Replica> > replicas;
+	for(size_t r = 0; r < replicasNum; r++)
+		replicas.emplace_back(std::make_unique<Replica>(articlesNum, usersNum, rulesAttrPath));
+
+	std::chrono::milliseconds startTime = std::chrono::duration_cast< std::chrono::milliseconds >
+			(std::chrono::system_clock::now().time_since_epoch());
+
+	if(replicasNum == 1)
+	{
+		Replica& replica = *replicas.front();
+		for(size_t pass = 0; pass < passesNum; pass++)
 		{
-			std::cout << "pass = " << pass << "\n";
+			this->pass(replica, pass, articlesPeriod, displayPeriod);
 
-			std::chrono::milliseconds finishTime = std::chrono::duration_cast< std::chrono::milliseconds >
-					(std::chrono::system_clock::now().time_since_epoch());
-			std::cout << "time = " << (finishTime - startTime).count() << "\n";
+			if(s_displayEnable && ((pass % displayPeriod) == 0))
+				show(pass, startTime);
 
-			if(_stratRepresentation)
+			if(pass && (pass % reportPeriod) == 0)
+				save();
+			traceUtility(pass, pass + 1, convergencePeriod);
+		}
+	}
+	else
+	{
+		//passesNum - общее число проходов всех реплик; реплика 0 считается в этом потоке
+		boost::asio::thread_pool pool(replicasNum - 1);
+		_strats.setDeferEvolution(true);
+		size_t pass = 0;
+		while(pass < passesNum)
+		{
+			size_t epoch = std::min(replicaEpoch, ((passesNum - pass) + replicasNum - 1) / replicasNum);
+			//у реплик 1.. свои потоки генератора, зерна выдает поток моделирования
+			for(size_t r = 1; r < replicasNum; r++)
+				replicas[r]->seed = static_cast<unsigned>(Rnd::engine()()) | 1;
+			auto runEpoch = [this, &replicas, pass, epoch, articlesPeriod, displayPeriod](size_t r)
 			{
-				_strats.sendTo(_stratRepresentation);
-				_stratRepresentation->show();
-			}
-			if(_probsRepresentation)
+				Replica& replica = *replicas[r];
+				try
+				{
+					//настройки и генератор - thread_local, привязываем их к потоку пула
+					std::unique_ptr<Settings::Scope> scope;
+					if(r)
+					{
+						scope = std::make_unique<Settings::Scope>(_settings);
+						loadSettings();
+						Rnd::seed(replica.seed);
+					}
+					StratPopulation::setObservationLog(&replica.observations);
+					for(size_t i = 0; i < epoch; i++)
+						this->pass(replica, pass + i, articlesPeriod, displayPeriod);
+				}
+				catch(...)
+				{
+					replica.error = std::current_exception();
+				}
+				StratPopulation::setObservationLog(nullptr);
+			};
+			std::atomic<size_t> pending(replicasNum - 1);
+			std::mutex mutex;
+			std::condition_variable cv;
+			for(size_t r = 1; r < replicasNum; r++)
+				boost::asio::post(pool, [&runEpoch, &pending, &mutex, &cv, r]()
+				{
+					runEpoch(r);
+					std::unique_lock<std::mutex> lock(mutex);
+					if(--pending == 0)
+						cv.notify_all();
+				});
+			runEpoch(0);
 			{
-				_strats.updateProbsRepresentation(_probsRepresentation);
-				_probsRepresentation->show();
+				std::unique_lock<std::mutex> lock(mutex);
+				cv.wait(lock, [&pending](){return pending == 0;});
 			}
+			for(auto& replica : replicas)
+				if(replica->error)
+					std::rethrow_exception(replica->error);
+
+			//барьер: наблюдения всех реплик по порядку, затем отложенная эволюция
+			for(auto& replica : replicas)
+				StratPopulation::applyObservations(replica->observations);
+			_strats.sync();
+
+			size_t prevPass = pass;
+			pass += epoch * replicasNum;
+			if(s_displayEnable && ((prevPass / displayPeriod) != (pass / displayPeriod)))
+				show(pass, startTime);
+			if((prevPass / reportPeriod) != (pass / reportPeriod))
+				save();
+			traceUtility(prevPass, pass, convergencePeriod);
 		}
+		_strats.setDeferEvolution(false);
+	}
+	save();
+	_writer->flush();
 
-		if(pass && (pass % reportPeriod) == 0)
-			save();
+	std::chrono::milliseconds finishTime = std::chrono::duration_cast< std::chrono::milliseconds >
+			(std::chrono::system_clock::now().time_since_epoch());
+	_metrics["passes"] = static_cast<double>(passesNum);
+	addConvergenceMetrics(convergenceTolerance);
+	_metrics["runSeconds"] = static_cast<double>((finishTime - startTime).count()) * 0.001;
+	_metrics["meanUtility"] = _strats.getMeanUtility();
+	//без фонового потока моделирование простаивало бы все время записи
+	double writeSeconds = _writer->getWriteSeconds();
+	_metrics["saveSnapshotSeconds"] = _saveSnapshotSeconds;
+	_metrics["saveStallSeconds"] = _saveStallSeconds;
+	_metrics["saveWriteSeconds"] = writeSeconds;
+	_metrics["saveStallSavedSeconds"] = std::max(writeSeconds - _saveStallSeconds, 0.0);
+	//подбор параметров Squelch: бюджет шага эволюции
+	auto fitStats = _strats.getFitStats();
+	_metrics["squelchFits"] = static_cast<double>(fitStats.fits);
+	_metrics["squelchFitEvals"] = static_cast<double>(fitStats.evals);
+	_metrics["squelchFitMaxEvals"] = static_cast<double>(fitStats.maxEvals);
+	_metrics["squelchFitSeconds"] = fitStats.seconds;
+	_metrics["squelchFitMaxSeconds"] = fitStats.maxSeconds;
+	//разброс полезности внутри блоков сценариев против общего; с population.crn
+	//внутри блока остаются только различия стратегий
+	if(StratPopulation::isScenarioTracking())
+	{
+		auto variance = _strats.getScenarioVariance();
+		_metrics["crnWithinVariance"] = variance.getWithin();
+		_metrics["crnTotalVariance"] = variance.getTotal();
+		_metrics["crnVarianceReduction"] = (variance.getTotal() > 0.0) ?
+				(1.0 - (variance.getWithin() / variance.getTotal())) : 0.0;
+	}
+	//новорожденные, получившие априорную оценку из архива полезности генома
+	auto archiveSeeds = _strats.getArchiveSeeds();
+	_metrics["archiveSeeded"] = static_cast<double>(archiveSeeds.first);
+	_metrics["archiveNewborns"] = static_cast<double>(archiveSeeds.second);
+	//отбор потомков суррогатом: шаги, на которых он был включен, и качество его предсказаний
+	auto surrogateStats = _strats.getSurrogateStats();
+	_metrics["surrogateActiveSteps"] = surrogateStats[0];
+	_metrics["surrogateSteps"] = surrogateStats[1];
+	_metrics["surrogateCorrelation"] = surrogateStats[2];
+	_metrics["surrogateRmse"] = surrogateStats[3];
+	//разнообразие геномов внутри кланов, среднее по кланам и популяциям
+	auto diversity = _strats.getDiversity();
+	_metrics["diversityVariance"] = diversity.variance;
+	_metrics["diversityPairwiseDist"] = diversity.pairwiseDist;
+	_metrics["diversityRadius"] = diversity.radius;
+	//популяции групп стека, в которые пришел хотя бы один пользователь
+	_metrics["populationsActive"] = static_cast<double>(_strats.getActiveNum());
+	if(_islands)
+	{
+		auto migrantsNum = _strats.getMigrantsNum();
+		_metrics["islandMigrantsSent"] = static_cast<double>(migrantsNum.first);
+		_metrics["islandMigrantsReceived"] = static_cast<double>(migrantsNum.second);
 	}
 }
 
-StratEnvironment::StratEnvironment(const std::string& src, bool loadFromFile)
+void StackGroups::init(const std::string& path)
 {
+	_borders.clear();
+	_min = Settings::get(path, "min");
 	size_t i = 0;
-	_minStackSize = Settings::get("user.stackGroupBorders", "min");
-	while(Settings::exist("user.stackGroupBorders", std::string("_") + std::to_string(i)))
-		_stackBorders.emplace_back(Settings::get("user.stackGroupBorders", std::string("_") + std::to_string(i++)));
-	i = 0;
+	while(Settings::exist(path, std::string("_") + std::to_string(i)))
+		_borders.emplace_back(Settings::get(path, std::string("_") + std::to_string(i++)));
+	size_t bands = Settings::exist(path, "bands") ? Settings::attribute(path, "bands").as_uint() : 0;
+	if(bands > 1)
+	{
+		if(!_borders.empty())
+			throw std::runtime_error("StackGroups::init: both bands and explicit borders are set");
+		double max = Settings::get(path, "max");
+		if((_min <= 0.0) || (max <= _min))
+			throw std::runtime_error("StackGroups::init: bands need 0 < min < max");
+		for(size_t band = 1; band < bands; band++)
+			_borders.push_back(_min * std::pow(max / _min, static_cast<double>(band) / static_cast<double>(bands - 1)));
+	}
+	if(!std::is_sorted(_borders.begin(), _borders.end()))
+		throw std::runtime_error("StackGroups::init: borders must ascend");
+}
 
-	_populations.resize(_stackBorders.size() + 1);
+void StratEnvironment::init(const std::string& src, bool loadFromFile)
+{
+	_stackGroups.init("user.stackGroupBorders");
+	bool lazy = Settings::exist("user.stackGroupBorders", "lazy") &&
+			Settings::attribute("user.stackGroupBorders", "lazy").as_bool();
+
+	_populations.clear();
+	_pool.reset();
+	size_t evolutionThreads = Settings::exist("population.run", "evolutionThreads") ?
+			Settings::attribute("population.run", "evolutionThreads").as_uint() : 0;
+	if(evolutionThreads)
+		_pool = std::make_unique<boost::asio::thread_pool>(evolutionThreads);
+
+	_populations.resize(_stackGroups.size());
+	_active = std::vector<std::atomic<StratPopulation*> >(_populations.size());
 	size_t n = 0;
 
-	for(auto& population : _populations)
-		population = std::make_unique<StratPopulation>(n++);
+	//лениво создаются популяции групп, которых нет и в загруженном файле
+	if(lazy || loadFromFile)
+		_lazySeed = (static_cast<uint64_t>(Rnd::engine()()) << 32) | Rnd::engine()();
+	if(!lazy)
+		for(auto& population : _populations)
+			population = std::make_unique<StratPopulation>(n++, _pool.get());
+	//true - популяция читается из файла; пустая группа (сохранена с lazy) без lazy
+	//заполняется из strat.init, как при создании в create
+	auto make = [this, lazy](size_t p, bool empty)
+	{
+		if(lazy && !empty)
+			_populations[p] = std::make_unique<StratPopulation>(p, _pool.get());
+		else if(empty && !lazy)
+			initFresh(p, *_populations[p]);
+		return !empty;
+	};
 
-	if(loadFromFile)
+	if(loadFromFile && PopulationArchive::check(src))
+	{
+		PopulationArchive archive(src);
+		if(archive.getPopulationsNum() != _populations.size())
+			throw std::runtime_error(std::string("StratEnvironment::StratEnvironment: wrong populations size"));
+		for(size_t p = 0; p < _populations.size(); p++)
+			if(make(p, !archive.getClansNum(p)))
+				_populations[p]->init(archive, p);
+	}
+	else if(loadFromFile)
 	{
 		pugi::xml_document doc;
 		if (!doc.load_file(src.c_str()))
@@ -1082,45 +2423,51 @@ StratEnvironment::StratEnvironment(const std::string& src, bool loadFromFile)
 		pugi::xml_node parent = doc.first_child();
 
 		Xml::NodesList populationNodes(parent, "population_");
-		auto iPopulation = _populations.begin();
 		n = 0;
-		while((!populationNodes.finished()) && (iPopulation != _populations.end()))
+		while((!populationNodes.finished()) && (n < _populations.size()))
 		{
-			(*iPopulation)->init(populationNodes.get());
-			iPopulation++;
+			if(make(n, Xml::NodesList(populationNodes.get(), "clan_").finished()))
+				_populations[n]->init(populationNodes.get());
 			populationNodes.next();
 			n++;
 		}
 
-		if((!populationNodes.finished()) || (iPopulation != _populations.end()))
+		if((!populationNodes.finished()) || (n != _populations.size()))
 			throw std::runtime_error(std::string("StratEnvironment::StratEnvironment: wrong populations size"));
 
 	}
-	else
+	else if(!lazy)
 		for(auto& population : _populations)
 			population->init(src);
 
+	for(size_t p = 0; p < _populations.size(); p++)
+		_active[p].store(_populations[p].get());
 }
 
-double StratEnvironment::fixStackSize(double stack) const
-{
-	size_t i = getUserType(stack);
-	return(!i) ? _minStackSize : _stackBorders[i - 1];
-}
-
-size_t StratEnvironment::getUserType(double stack) const
-{
-	size_t i = 0;
-	while((i < _stackBorders.size()) && (stack > _stackBorders[i]))
-		i++;
-	return i;
-}
-
-Environment::Environment(const std::string& resultFileName, const std::string& srcFileName):
-		_strats(srcFileName.empty() ? "strat.init" : srcFileName, !srcFileName.empty()),
+Environment::Environment(const std::shared_ptr<const Settings>& settings,
+		const std::string& resultFileName, const std::string& srcFileName):
+		_settings(settings),
 		_resultFileName(resultFileName),
-		_globalProps{0.0, 0.0}
-{
+		_binaryReport(false),
+		_writer(std::make_unique<PopulationWriter>()),
+		_saveSnapshotSeconds(0.0),
+		_saveStallSeconds(0.0)
+{
+	Settings::Scope settingsScope(_settings);
+	_binaryReport = Settings::exist("report", "format") &&
+			(std::string(Settings::attribute("report", "format").as_string()) == "binary");
+	_strats.init(srcFileName.empty() ? "strat.init" : srcFileName, !srcFileName.empty());
+	_settings->save(getSettingsFileName(_resultFileName));
+	if(Settings::exist("report.history", "enable") && Settings::attribute("report.history", "enable").as_bool())
+	{
+		PopulationArchive::Layout layout;
+		layout.phenosizes.assign(Strat::PHENOSIZES.begin(), Strat::PHENOSIZES.end());
+		for(auto t : Strat::getSchemaFeatureTypes())
+			layout.featureTypes.push_back(static_cast<uint32_t>(t));
+		layout.settingsHash = std::stoull(_settings->hash(), nullptr, 16);
+		_history = std::make_unique<GenerationLog>(getHistoryFileName(_resultFileName), layout, _strats.size());
+		_strats.setGenerationLog(_history.get());
+	}
 	if(Settings::attribute("display", "enable").as_bool())
 	{
 		_stratRepresentation = makeRepresentation("display.strat", "");
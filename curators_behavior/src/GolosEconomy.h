@@ -1,19 +1,39 @@
 #ifndef GOLOSECONOMY_H_
 #define GOLOSECONOMY_H_
 #include <list>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
 #include <memory>
+#include <mutex>
 #include <vector>
 #include <set>
 #include <array>
 #include <map>
 #include <cmath>
+#include <limits>
 #include <string>
 #include <stack>
 #include <iostream>
 #include <fstream>
+#include <boost/asio/thread_pool.hpp>
 #include "Utils.h"
 #include "DataRepresentation.h"
+#include "GenerationLog.h"
+#include "IslandChannel.h"
+#include "PopulationArchive.h"
+#include "PopulationWriter.h"
+#include "StratOptimizer.h"
+#include "VecMath.h"
 //#define VERBOSE_MODE
+//#define STRAT_FAST_MATH //приближенные exp/log/pow при оценке стратегий, см. FastMath
+
+#ifdef STRAT_FAST_MATH
+using StratMath = FastMath;
+#else
+using StratMath = ExactMath;
+#endif
 
 class User;
 class Article;
@@ -180,159 +200,645 @@ public:
 #endif
 };
 
+enum class StratFeatureType{PASSES_LN, RATING_LN, TASTE_DIST, UNDEF};
+
+//фенотип схемы стратегии - список типов его признаков
+template<StratFeatureType... Types>
+struct StratPhenotype
+{
+	static constexpr size_t SIZE = sizeof...(Types);
+	static constexpr StratFeatureType getFeatureType(size_t feature)
+	{
+		return (feature < SIZE) ? std::array<StratFeatureType, SIZE>{{Types...}}[feature] : StratFeatureType::UNDEF;
+	};
+};
+
+//схема стратегии - фенотипы в порядке Strat::ActType; все размеры и типы известны при компиляции
+template<class... Phenotypes>
+struct StratSchema
+{
+	static constexpr size_t ACTS_COUNT = 0;
+	static constexpr size_t FEATURES_NUM = 0;
+	static constexpr size_t getPhenosize(size_t) {return 0;};
+	static constexpr StratFeatureType getFeatureType(size_t, size_t) {return StratFeatureType::UNDEF;};
+};
+
+template<class Head, class... Tail>
+struct StratSchema<Head, Tail...>
+{
+	using Rest = StratSchema<Tail...>;
+	static constexpr size_t ACTS_COUNT = 1 + Rest::ACTS_COUNT;
+	static constexpr size_t FEATURES_NUM = Head::SIZE + Rest::FEATURES_NUM;
+	static constexpr std::array<size_t, ACTS_COUNT> PHENOSIZES = {{Head::SIZE, Tail::SIZE...}};
+	static constexpr size_t getPhenosize(size_t phen) {return phen ? Rest::getPhenosize(phen - 1) : Head::SIZE;};
+	static constexpr StratFeatureType getFeatureType(size_t phen, size_t feature)
+	{
+		return phen ? Rest::getFeatureType(phen - 1, feature) : Head::getFeatureType(feature);
+	};
+};
+
+template<class Head, class... Tail>
+constexpr std::array<size_t, StratSchema<Head, Tail...>::ACTS_COUNT> StratSchema<Head, Tail...>::PHENOSIZES;
+
 class Strat final
 {
 	static double sigmoid(double arg) {return 1.0 / (1.0 + std::exp(-arg));};
 public:
 	enum class ActType{PICK_WEIGHT, BET_WEIGHT, count};
+	using FeatureType = StratFeatureType;
+	//Новый признак: значение StratFeatureType, его имя в getFeatureTypeName,
+	//вычисление в User::getFeature и место в схеме.
+	using Schema = StratSchema<
+			StratPhenotype<FeatureType::PASSES_LN, FeatureType::RATING_LN>,//PICK_WEIGHT
+			StratPhenotype<FeatureType::TASTE_DIST, FeatureType::RATING_LN> >;//BET_WEIGHT
 	static constexpr size_t ACTS_COUNT = static_cast<size_t>(ActType::count);
-	static constexpr std::array<size_t, ACTS_COUNT> PHENOSIZES = {2, 2};//lengths of phenotypes
+	static_assert(Schema::ACTS_COUNT == ACTS_COUNT, "Strat::Schema: wrong number of phenotypes");
+	static constexpr std::array<size_t, ACTS_COUNT> PHENOSIZES = Schema::PHENOSIZES;//lengths of phenotypes
+	//значения признаков фенотипа, каждое в [0, 1]
+	template<ActType actType>
+	using Features = std::array<double, Schema::PHENOSIZES[static_cast<size_t>(actType)]>;
 	static ProjectedDataRepresentation::PointStruct getPointStruct();
 	static ProjectedDataRepresentation::PointStruct getProbsPointStruct(size_t size);
 	static std::string getProbsProjName(size_t populationNum, size_t phen, const std::vector<size_t>& features);
-	enum class FeatureType{PASSES_LN, RATING_LN, TASTE_DIST, UNDEF};
-	class Feature
+
+	//геном стратегии - строка StratMatrix: по фенотипам displ, затем (factor, bend) каждого признака
+	static constexpr size_t getGenesNum()
 	{
-		const FeatureType _featureType;
-		double _val;
-	public:
-		Feature(FeatureType t = FeatureType::UNDEF): _featureType(t), _val(0.0){};
-		double get()const {return _val;};
-		void set(double v) {_val = std::max(std::min(v, 1.0), 0.0);};
-		bool checkType(FeatureType t)const {return (_featureType == t);};
+		size_t ret = 0;
+		for(size_t phen = 0; phen < ACTS_COUNT; phen++)
+			ret += 1 + (2 * PHENOSIZES[phen]);
+		return ret;
 	};
-
-private:
-	struct FeatureParams
+	static constexpr size_t getFeaturesNum()
 	{
-		const FeatureType _featureType;
-	private:
-		double _factor;
-		double _bend;
-		double _power;
-
-	static double calcPower(double bend);
-	public:
-		FeatureParams(): _featureType(FeatureType::UNDEF), _factor(0.0), _bend(0.0), _power(calcPower(0.0)){};
-		FeatureParams(FeatureType t, double f = 0.0, double b = 0.0)
-			: _featureType(t), _factor(f), _bend(b), _power(calcPower(b)){};
-		double factor()const {return _factor;};
-		double bend()const {return _bend;};
-		double power()const {return _power;};
-		FeatureType featureType()const{return _featureType;};
-		void setFactor(double arg) {_factor = arg;};
-		void setBend(double arg) {_bend = arg; _power = calcPower(arg);};
+		size_t ret = 0;
+		for(size_t phen = 0; phen < ACTS_COUNT; phen++)
+			ret += PHENOSIZES[phen];
+		return ret;
+	};
+	static constexpr size_t getDisplIndex(size_t phen)
+	{
+		size_t ret = 0;
+		for(size_t p = 0; p < phen; p++)
+			ret += 1 + (2 * PHENOSIZES[p]);
+		return ret;
 	};
-	struct Phenotype
+	static constexpr size_t getFactorIndex(size_t phen, size_t feature) {return getDisplIndex(phen) + 1 + (2 * feature);};
+	static constexpr size_t getBendIndex(size_t phen, size_t feature) {return getFactorIndex(phen, feature) + 1;};
+	static constexpr size_t getFeatureIndex(size_t phen, size_t feature)//номер признака среди всех признаков стратегии
 	{
-		std::vector<FeatureParams> featureParams;
-		double displ;
+		size_t ret = feature;
+		for(size_t p = 0; p < phen; p++)
+			ret += PHENOSIZES[p];
+		return ret;
 	};
 
-	std::array<Phenotype, ACTS_COUNT> _phenotypes;
-	static double activation(double arg) {return sigmoid(arg);};
-	std::string _initAttrName;
+	static const std::string& getFeatureTypeName(FeatureType featureType);
+	static FeatureType getFeatureType(const std::string& name);
+	static std::vector<FeatureType> getSchemaFeatureTypes();
+	static std::string getSchemaName(const std::vector<FeatureType>& featureTypes);//"PASSES_LN,RATING_LN;..."
+	//типы признаков из xml или архива должны совпадать со схемой, с которой собрана модель
+	static void checkSchema(const std::vector<FeatureType>& featureTypes);
+
+	static double calcPower(double bend);
+	template<class Math = StratMath>
+	static double activation(double arg) {return Math::sigmoid(arg);};
 	static double mix(double lhs, double rhs, bool pnx = true);
-	void init(const pugi::xml_node& node);
 
-//---utility stuff---
-	static double s_expMoving;
-	double _weight;
-	double _expUtility;
-	double _smoothedUtility;
-public:
-	void initUtility() {_weight = 0.0; _expUtility = 0.0; _smoothedUtility = 0.0;};
-	void pushObservatedUtility(double val);
-	void setSmoothedVal(double arg) {_smoothedUtility = arg;};
-	double getObservation(bool strict = true) const;
-	double getWeight()const{return _weight;};
-	double getSmoothedUtility()const {return _smoothedUtility;};
+	//ядра над строками матрицы геномов
+	static void init(double* genes, FeatureType* featureTypes, const pugi::xml_node& node);
+	static void born(double* child, const double* parentA, const double* parentB);
+	//размер фенотипа известен при компиляции, проверок на этом пути нет
+	template<ActType actType, class Math = StratMath>
+	static double get(const double* genes, const double* powers, const Features<actType>& features)
+	{
+		const size_t phen = static_cast<size_t>(actType);
+		const double* factors = genes + getFactorIndex(phen, 0);
+		powers += getFeatureIndex(phen, 0);
+		double ret = genes[getDisplIndex(phen)];
+		for(size_t i = 0; i < features.size(); i++)
+			ret += Math::pow(features[i], powers[i]) * factors[2 * i];
+
+		return  activation<Math>(ret);//>0
+	};
+	static double dist(const double* lhs, const double* rhs);
+	static void sendTo(const double* genes, std::unique_ptr<ProjectedDataRepresentation>& representation, size_t color);
+	static void print(const double* genes, const std::string& name, std::ofstream& file);
+};
 
+//Все стратегии популяции: геномы одной непрерывной матрицей (строка - слот стратегии),
+//отдельно предвычисленные степени признаков и оценки полезности.
+//Стратегия адресуется номером слота, слот не перемещается при эволюции.
+class StratMatrix final
+{
+	static thread_local double s_expMoving;
+	std::vector<double> _genes;
+	std::vector<double> _powers;
+	std::vector<double> _weight;
+	std::vector<double> _expUtility;
+	std::vector<double> _smoothedUtility;
+	//ревизия генома слота, уникальна среди всех матриц, копии генома сохраняют ее;
+	//по ней Squelch находит слоты, для которых надо пересчитать расстояния
+	std::vector<uint64_t> _revisions;
+	static std::atomic<uint64_t> s_lastRevision;
+	void updatePowers(size_t slot);
+	void onGenesChanged(size_t slot);
 public:
-	Strat();
-	Strat(const std::string& initAttrName);
-	Strat(const pugi::xml_node& node);
-	const std::string& getInitAttrName()const {return _initAttrName;};
-	void born(const Strat& parentA, const Strat& parentB);
-
-	double get(const std::vector<Feature>& features, ActType actType, bool disableFeatureTypeCheck = false) const;
-
-	void sendTo(std::unique_ptr<ProjectedDataRepresentation>& representation, size_t color) const;
+	static void loadSettings();
+	size_t size()const {return _weight.size();};
+	void resize(size_t size);
+	const std::vector<double>& getGenesData()const {return _genes;};
+	double* getGenes(size_t slot) {return _genes.data() + (slot * Strat::getGenesNum());};
+	const double* getGenes(size_t slot)const {return _genes.data() + (slot * Strat::getGenesNum());};
+	const double* getPowers(size_t slot)const {return _powers.data() + (slot * Strat::getFeaturesNum());};
+
+	void init(size_t slot, const pugi::xml_node& node);
+	void init(size_t first, const double* genes, size_t num, const std::vector<Strat::FeatureType>& featureTypes);
+	void born(size_t child, size_t parentA, size_t parentB);
+	void assign(size_t slot, const StratMatrix& src);//геном из того же слота src, оценки сбрасываются
+	void assign(size_t slot, const double* genes);//новый геном, оценки сбрасываются
+
+	void initUtility(size_t slot) {_weight[slot] = 0.0; _expUtility[slot] = 0.0; _smoothedUtility[slot] = 0.0;};
+	//априорная оценка: как будто слот уже получил наблюдения суммарного веса weight
+	void initUtility(size_t slot, double weight, double utility) {_weight[slot] = weight; _expUtility[slot] = utility; _smoothedUtility[slot] = utility;};
+	static double getExpMoving() {return s_expMoving;};
+	void pushObservatedUtility(size_t slot, double val);
+	void setSmoothedVal(size_t slot, double arg) {_smoothedUtility[slot] = arg;};
+	double getObservation(size_t slot, bool strict = true) const;
+	double getWeight(size_t slot)const{return _weight[slot];};
+	double getSmoothedUtility(size_t slot)const {return _smoothedUtility[slot];};
+	uint64_t getRevision(size_t slot)const {return _revisions[slot];};
+
+	template<Strat::ActType actType, class Math = StratMath>
+	double get(size_t slot, const Strat::Features<actType>& features) const
+		{return Strat::get<actType, Math>(getGenes(slot), getPowers(slot), features);};
+	double dist(size_t lhs, size_t rhs) const {return Strat::dist(getGenes(lhs), getGenes(rhs));};
+	//средний по всем стратегиям отклик в каждой точке points (строки по PHENOSIZES[actType] значений признаков),
+	//внутренний цикл идет по стратегиям и векторизуется
+	void getAvgProbs(Strat::ActType actType, const std::vector<double>& points, std::vector<double>& probs)const;
+};
 
-	double dist(const Strat& rhs) const;
-	static std::shared_ptr<Strat> getCenter(const std::vector<std::shared_ptr<Strat> >& args);
-	double getNorm()const;
+//Наблюдаемая полезность по ячейкам квантованного генома: все наблюдения стратегий, чьи гены
+//попали в одну ячейку со стороной quantum. Вес ячейки затухает на squelch.expMoving за цикл pick -
+//за цикл каждая стратегия получает в среднем одно наблюдение, как и в StratMatrix.
+//Таблица фиксированного размера с прямой адресацией: при коллизии старая ячейка уступает место,
+//если ее вес меньше одного наблюдения, иначе новое наблюдение в архив не попадает.
+class FitnessArchive final
+{
+	struct Cell
+	{
+		uint64_t key = 0;//0 - пустая
+		double weight = 0.0;
+		double utility = 0.0;
+		size_t cycle = 0;
+	};
+	std::vector<Cell> _cells;
+	double _quantum;
+	//ключи слотов, пересчитываются при смене ревизии генома
+	std::vector<uint64_t> _keys;
+	std::vector<uint64_t> _revisions;
+	static double getDecay(size_t cycles) {return std::pow(1.0 - StratMatrix::getExpMoving(), static_cast<double>(cycles));};
+public:
+	explicit FitnessArchive(const std::string& path);//capacity == 0 - архив выключен
+	explicit operator bool()const {return !_cells.empty();};
+	uint64_t getKey(const StratMatrix& strats, size_t slot);
+	void push(uint64_t key, double val, size_t cycle);
+	std::pair<double, double> get(uint64_t key, size_t cycle)const;//затухший вес и полезность, вес 0 - промах
+	size_t getCapacity()const {return _cells.size();};
+};
 
-	void print(const std::string& name, std::ofstream& file) const;
+//Суррогат полезности для отбора потомков до моделирования: ядерная регрессия по оцененным
+//стратегиям популяции с ядром Squelch (вес наблюдений / (1 + distFactor * dist)).
+//Снимок оцененных стратегий берется до размножения, задачи кланов читают его параллельно
+//и пишут предсказания в слоты своих кланов. Качество - скользящая корреляция предсказаний
+//с наблюдаемой полезностью потомков, когда те получили оценки.
+class StratSurrogate final
+{
+	std::vector<double> _genes;
+	std::vector<double> _utility;
+	std::vector<double> _weight;
+	double _distFactor;
+	bool _active;//false - предсказания только для проверки, отбора нет
+	std::vector<double> _predictions;//по слотам, NaN - нет предсказания
+	//скользящие суммы пар (предсказание, наблюдение)
+	double _n, _p, _o, _pp, _oo, _po;
+	size_t _scored;//всего сверенных пар
+public:
+	StratSurrogate() : _distFactor(1.0), _active(true), _n(0.0), _p(0.0), _o(0.0), _pp(0.0), _oo(0.0), _po(0.0), _scored(0){};
+	void build(const StratMatrix& strats, double distFactor);
+	bool empty()const {return _weight.empty();};
+	bool isActive()const {return _active;};
+	void setActive(bool active) {_active = active;};
+	double predict(const double* genes)const;
+	void setPrediction(size_t slot, double val) {_predictions[slot] = val;};
+	void forget(size_t slot) {if(slot < _predictions.size()) _predictions[slot] = std::numeric_limits<double>::quiet_NaN();};
+	//сверяет предсказания со слотами, получившими с тех пор оценки; window - память в парах
+	void score(const StratMatrix& strats, double window);
+	double getSamples()const {return _n;};
+	size_t getScored()const {return _scored;};
+	double getCorrelation()const;
+	double getRmse()const {return (_n > 0.0) ? std::sqrt(std::max((_pp - (2.0 * _po) + _oo) / _n, 0.0)) : 0.0;};
 };
 
+//Разнообразие кланов без пересчета с нуля: суммы генов и их квадратов по клану меняются
+//при каждом рождении и переходе слота между кланами, из них за O(genesNum) получаются центр,
+//дисперсии генов и средний квадрат попарного расстояния (2n / (n - 1) * сумма дисперсий).
+//Радиус - максимум, его так не поддержать: он считается проходом по клану в snapshot.
+//Там же суммы клана пересчитываются заново, если с прошлого пересчета событий было больше,
+//чем членов, - ошибки округления не копятся. Задачи кланов в пуле меняют только суммы своего клана.
+class ClanDiversity final
+{
+public:
+	struct Stats
+	{
+		double variance = 0.0;//сумма дисперсий генов
+		double pairwiseDist = 0.0;//корень среднего квадрата расстояния между членами
+		double radius = 0.0;//на момент snapshot
+		void add(const Stats& rhs) {variance += rhs.variance; pairwiseDist += rhs.pairwiseDist; radius += rhs.radius;};
+		void scale(double mul) {variance *= mul; pairwiseDist *= mul; radius *= mul;};
+	};
+private:
+	struct Clan
+	{
+		size_t n = 0;
+		size_t updates = 0;
+		std::array<double, Strat::getGenesNum()> sum;
+		std::array<double, Strat::getGenesNum()> sumSq;
+		std::array<double, Strat::getGenesNum()> center;
+		double radius = 0.0;
+		void add(const double* genes, double sign);
+	};
+	std::vector<Clan> _clans;
+	std::vector<uint32_t> _slotClans;
+	void rebuild(Clan& clan, const StratMatrix& strats, const std::vector<size_t>& members);
+public:
+	void init(const StratMatrix& strats, const std::vector<std::vector<size_t> >& clans);
+	//вызывается до strats.assign: геном слота oldGenes сменится на newGenes
+	void replace(size_t slot, const double* oldGenes, const double* newGenes);
+	//слоты lhs и rhs меняются кланами
+	void exchange(size_t lhs, size_t rhs, const double* lhsGenes, const double* rhsGenes);
+	//центры и радиусы кланов для getCenter и getRadius
+	void snapshot(const StratMatrix& strats, const std::vector<std::vector<size_t> >& clans);
+	size_t size()const {return _clans.size();};
+	const double* getCenter(size_t clan)const {return _clans[clan].center.data();};
+	double getRadius(size_t clan)const {return _clans[clan].radius;};
+	double getVariance(size_t clan, size_t gene)const;
+	Stats getStats(size_t clan)const;
+};
 
 class StratPopulation final
 {
-	static size_t s_iterSize;
+public:
+	//наблюдение реплики окружения, копится в журнале потока и применяется на барьере
+	struct Observation
+	{
+		StratPopulation* population;
+		size_t slot;
+		double val;
+		uint64_t scenario;
+		size_t cycle;
+	};
+	//разброс наблюдаемой полезности внутри популяции и внутри блоков сценариев
+	//(стратегии клана, выбранные подряд в одном цикле pick): суммы квадратов отклонений и степени свободы
+	struct ScenarioVariance
+	{
+		double withinSS = 0.0;
+		double withinDf = 0.0;
+		double totalSS = 0.0;
+		double totalDf = 0.0;
+		void add(const ScenarioVariance& rhs)
+			{withinSS += rhs.withinSS; withinDf += rhs.withinDf; totalSS += rhs.totalSS; totalDf += rhs.totalDf;};
+		double getWithin()const {return (withinDf > 0.0) ? (withinSS / withinDf) : 0.0;};
+		double getTotal()const {return (totalDf > 0.0) ? (totalSS / totalDf) : 0.0;};
+	};
+private:
+	static thread_local std::vector<Observation>* s_observations;
+	static thread_local size_t s_iterSize;
 	size_t _populationNum;
-	static double s_elit;
-	static double s_migrationRate;
+	static thread_local double s_elit;
+	static thread_local double s_migrationRate;
+	//устойчивый режим: на каждой границе цикла pick заменяются до s_steadyReplace худших в клане среди
+	//стратегий с весом наблюдений не меньше s_steadyWeight (вес растет до 1 / squelch.expMoving),
+	//0 - поколения по s_iterSize циклов
+	static thread_local double s_steadyWeight;
+	static thread_local size_t s_steadyReplace;
+	//острова: каждые s_islandPeriod шагов эволюции s_islandMigrants лучших уходят следующему острову,
+	//столько же принятых заменяют худших
+	static thread_local size_t s_islandPeriod;
+	static thread_local size_t s_islandMigrants;
+	//общие сценарии (common random numbers): стратегии клана в одном цикле pick оцениваются
+	//на одном потоке Rnd, из которого User тянет профиль, - разности полезностей парные;
+	//s_scenarioBlock подряд выбранных стратегий клана делят сценарий, 0 - весь клан;
+	//разброс по блокам сценариев считается с общими сценариями или с population.crn track
+	static thread_local bool s_commonScenarios;
+	static thread_local bool s_scenarioTracking;
+	static thread_local size_t s_scenarioBlock;
+	static thread_local double s_archiveMaxWeight;//предел априорного веса новорожденной стратегии
+	//суррогат: s_surrogateCandidates потомков на слот, остается лучший по предсказанию (0 - выключен);
+	//при корреляции предсказаний ниже s_surrogateMinCorrelation на s_surrogateWindow парах
+	//отбор отключается, предсказания для одного потомка продолжают считаться до восстановления
+	static thread_local size_t s_surrogateCandidates;
+	static thread_local double s_surrogateMinCorrelation;
+	static thread_local double s_surrogateWindow;
+	//журнал поколений: запись каждые s_historyPeriod шагов эволюции, опорная - каждые s_historyKeyframe записей
+	//(0 - только начальная); при s_historyPeriod > 1 родитель может не попасть в журнал
+	static thread_local size_t s_historyPeriod;
+	static thread_local size_t s_historyKeyframe;
 	Func _migrationProb;
-	std::vector<std::vector<std::shared_ptr<Strat> > > _strats;
-	Squelch<Strat> _squelch;
+	std::unique_ptr<StratOptimizer> _optimizer;
+	StratMatrix _strats;
+	std::vector<std::vector<size_t> > _clans;//номера слотов кланов, при миграции слоты меняются кланами
+	Squelch<StratMatrix> _squelch;
 	std::pair<size_t, size_t> _index;
 	size_t _iteration;
+	std::vector<size_t> _mature;//буфер steadyStateStep и exchangeMigrants
+	IslandChannel* _islands;
+	size_t _sendRing;
+	size_t _receiveRing;
+	size_t _islandSteps;
+	std::vector<double> _migrant;
+	std::pair<size_t, size_t> _migrantsNum;//отправлено, принято
+	//блоки сценариев, в которые еще приходят наблюдения; старше SCENARIO_LAG циклов
+	//сворачиваются в _scenarioWithin и _scenarioTotal
+	struct ScenarioBlock
+	{
+		size_t cycle = 0;
+		size_t n = 0;
+		double sum = 0.0;
+		double sumSq = 0.0;
+		void add(double val) {++n; sum += val; sumSq += val * val;};
+		double getSS()const {return (n > 0) ? std::max(sumSq - ((sum * sum) / static_cast<double>(n)), 0.0) : 0.0;};
+	};
+	static constexpr size_t SCENARIO_LAG = 4;
+	size_t _cycle;
+	uint64_t _scenarioBase;
+	uint64_t _sweepKey;//ключ перестановок кланов в текущем цикле pick
+	//зерно ключей циклов pick: берется при init, дальше ключи - функция номера цикла,
+	//и от того, в каком потоке реплики закончился цикл, они не зависят
+	uint64_t _keySeed;
+	std::map<uint64_t, ScenarioBlock> _scenarioBlocks;
+	std::pair<double, double> _scenarioWithin;//сумма квадратов, степени свободы
+	ScenarioBlock _scenarioTotal;
+	FitnessArchive _archive;
+	std::vector<char> _reborn;//буфер синхронной эволюции
+	std::pair<size_t, size_t> _archiveSeeds;//новорожденные с оценкой из архива, все новорожденные
+	StratSurrogate _surrogate;
+	std::pair<size_t, size_t> _surrogateSteps;//с отбором, все
+	std::vector<StratOptimizer::Parents> _parents;//буфер синхронной эволюции, для новорожденных
+	ClanDiversity _diversity;
+	//родословная слотов для журнала поколений, ведется только при подключенном журнале
+	struct Lineage
+	{
+		uint64_t id = 0;
+		std::array<uint64_t, 2> parents = {0, 0};
+		uint32_t origin = GenerationLog::INITIAL;
+	};
+	GenerationLog* _log;
+	std::vector<Lineage> _lineage;
+	std::vector<char> _unlogged;//рождения после прошлой записи
+	std::vector<uint32_t> _loggedClans;
+	uint64_t _lastId;
+	uint64_t _generation;//записанных поколений
+	size_t _logSteps;
+	//реплики окружения выбирают стратегии из разных потоков, эволюция откладывается до барьера
+	std::mutex _pickMutex;
+	bool _deferEvolution;
+	size_t _deferredCycles;//циклы pick с прошлого барьера, шаги эволюции по ним делает sync
+
+	//Следующее поколение, которое считается в пуле, пока моделирование идет на текущем.
+	//Фазы: индекс Squelch, сглаживание групп Squelch, размножение кланов, миграция; задачи внутри фазы
+	//независимы, последняя завершившаяся запускает следующую фазу.
+	//Каждая задача получает свое зерно Rnd, выданное потоком моделирования,
+	//и подменяется поколение всегда на следующей границе цикла pick - результат
+	//не зависит от числа потоков и времени выполнения.
+	struct Generation
+	{
+		StratMatrix strats;
+		std::vector<std::vector<size_t> > clans;
+		std::vector<char> reborn;
+		std::vector<StratOptimizer::Parents> parents;
+		ClanDiversity diversity;
+		std::vector<unsigned> seeds;
+		StratSurrogate* surrogate = nullptr;
+		std::atomic<size_t> pending;
+		bool ready = false;
+		std::exception_ptr error;
+		std::mutex mutex;
+		std::condition_variable cv;
+	};
+	boost::asio::thread_pool* _pool;
+	std::shared_ptr<const Settings> _settings;
+	std::unique_ptr<Generation> _next;
 
-	void initIterations(){_index.first = _strats.size(); _index.second = 0; _iteration = 0;};
-	double getAvgProb(std::vector<Strat::Feature> features, Strat::ActType actType)const;
+	void initClans(const std::vector<size_t>& clanSizes);
+	void initIterations();
 	void evolutionStep();
-	void addStrats(const std::string& stratInitAttrName, size_t stratsNum, size_t clan, bool reset);
-	std::pair<std::shared_ptr<Strat>, double > getSphere(const std::vector<std::shared_ptr<Strat> >& clan);
+	void steadyStateStep();
+	void evolve();//на границе цикла pick
+	void exchangeMigrants();
+	void startEvolution();
+	void runEvolutionPhase(size_t phase);
+	void waitEvolution();
+	void finishEvolution();
+	void breedClan(StratMatrix& strats, ClanDiversity& diversity, std::vector<size_t>& clan, size_t clanNum,
+			std::vector<char>* reborn, std::vector<StratOptimizer::Parents>* parents, StratSurrogate* surrogate = nullptr)const;
+	//заменяет replaceNum худших из members геномами _optimizer, остальные выживают;
+	//reborn и parents - по слотам strats
+	void breed(StratMatrix& strats, ClanDiversity& diversity, std::vector<size_t>& members, size_t replaceNum, size_t clanNum,
+			std::vector<char>* reborn, std::vector<StratOptimizer::Parents>* parents, StratSurrogate* surrogate = nullptr)const;
+	void migrate(const StratMatrix& strats, ClanDiversity& diversity, std::vector<std::vector<size_t> >& clans)const;
+	void observe(size_t slot, double val, uint64_t scenario, size_t cycle);
+	void foldScenarios(size_t minCycle);
+	void seedFromArchive(size_t slot);
+	void seedFromArchive(const std::vector<char>& reborn);
+	StratSurrogate* prepareSurrogate();//на потоке моделирования перед размножением
+	void registerBirth(size_t slot, GenerationLog::Origin origin, const StratOptimizer::Parents& parents);
+	void registerBirths(const std::vector<char>& reborn, const std::vector<StratOptimizer::Parents>& parents);
+	void logGeneration();//после шага эволюции
+	void writeGeneration(bool keyframe);
+	static Squelch<StratMatrix>::FitOptions getFitOptions();
 
 public:
-	StratPopulation(size_t n): _populationNum(n),
+	static void loadSettings();
+	//pool == nullptr - эволюция считается синхронно в потоке моделирования
+	StratPopulation(size_t n, boost::asio::thread_pool* pool = nullptr): _populationNum(n),
 		 _migrationProb("population.migrationProb"),
-		 _squelch(Settings::attribute("squelch", "centralPointsNum").as_uint()), _iteration(0){};
+		 _optimizer(StratOptimizer::make("population.optimizer")),
+		 _squelch(Settings::attribute("squelch", "centralPointsNum").as_uint(),
+				 Settings::exist("squelch", "tolerance") ? Settings::get("squelch", "tolerance") : 0.0,
+				 getFitOptions()), _iteration(0), _islands(nullptr), _sendRing(0), _receiveRing(0), _islandSteps(0),
+		 _cycle(0), _scenarioBase(0), _sweepKey(0), _keySeed(0), _scenarioWithin(0.0, 0.0), _archive("population.archive"), _archiveSeeds(0, 0),
+		 _surrogateSteps(0, 0), _log(nullptr), _lastId(0), _generation(0), _logSteps(0),
+		 _deferEvolution(false), _deferredCycles(0),
+		 _pool(pool), _settings(Settings::current()){};
+	~StratPopulation();
+	StratPopulation(StratPopulation const&) = delete;
+	void operator=(StratPopulation const&) = delete;
 	void init(const std::string& stratInitAttrName);
 	void init(const pugi::xml_node& node);
-	void print(const std::string& name, std::ofstream& file)const;
-	std::shared_ptr<Strat>& pick();
+	void init(const PopulationArchive& archive, size_t populationNum);
+	void write(PopulationArchive::Layout& layout, std::vector<double>& genes)const;
+	//scenario - сценарий клана в текущем цикле cycle (0 без отслеживания сценариев)
+	size_t pick(uint64_t& scenario, size_t& cycle);
+	template<Strat::ActType actType, class Math = StratMath>
+	double get(size_t slot, const Strat::Features<actType>& features)const
+		{return _strats.get<actType, Math>(slot, features);};
+	void pushObservatedUtility(size_t slot, double val, uint64_t scenario, size_t cycle)
+	{
+		if(s_observations)
+			s_observations->push_back(Observation{this, slot, val, scenario, cycle});
+		else
+			observe(slot, val, scenario, cycle);
+	};
+	static bool isCommonScenarios() {return s_commonScenarios;};
+	static bool isScenarioTracking() {return s_scenarioTracking;};
+	//nullptr - наблюдения сразу идут в матрицу
+	static void setObservationLog(std::vector<Observation>* log) {s_observations = log;};
+	//применяет журнал по порядку и очищает его
+	static void applyObservations(std::vector<Observation>& log);
+	void setDeferEvolution(bool defer) {_deferEvolution = defer;};
+	//отложенная эволюция, когда другие потоки не читают популяцию: по шагу на каждый цикл эпохи,
+	//как без реплик, но все шаги после эпохи и на ее наблюдениях
+	void sync();
 
 	void sendTo(std::unique_ptr<ProjectedDataRepresentation>& representation, size_t color) const;
 	void updateProbsRepresentation(std::unique_ptr<ProjectedDataRepresentation>& representation)const;
+	std::pair<double, double> getUtilitySum()const;//сумма наблюдаемых полезностей и число оцененных стратегий
+	Squelch<StratMatrix>::FitStats getFitStats();//дожидается поколения, которое считается в пуле
+	void joinIslands(IslandChannel* channel, size_t sendRing, size_t receiveRing);
+	//пишет начальную популяцию и дальше каждое s_historyPeriod-е поколение, до первого pick
+	void setGenerationLog(GenerationLog* log);
+	std::pair<size_t, size_t> getMigrantsNum()const {return _migrantsNum;};
+	ScenarioVariance getScenarioVariance()const;
+	std::pair<size_t, size_t> getArchiveSeeds()const {return _archiveSeeds;};
+	std::pair<size_t, size_t> getSurrogateSteps()const {return _surrogateSteps;};
+	const StratSurrogate& getSurrogate()const {return _surrogate;};
+	ClanDiversity::Stats getDiversity()const;//среднее по кланам
 };
 
-class StratEnvironment
+//стратегия, которой пользуется User: популяция и номер слота в ее матрице
+struct StratRef
 {
-	std::vector<double> _stackBorders;
-	double _minStackSize;
+	StratPopulation* population = nullptr;
+	size_t slot = 0;
+	uint64_t scenario = 0;
+	size_t cycle = 0;//цикл pick, в котором выбрана стратегия
+	explicit operator bool()const {return population != nullptr;};
+	template<Strat::ActType actType, class Math = StratMath>
+	double get(const Strat::Features<actType>& features)const
+		{return population->get<actType, Math>(slot, features);};
+	void pushObservatedUtility(double val)const {population->pushObservatedUtility(slot, val, scenario, cycle);};
+};
 
-	std::vector<std::unique_ptr<StratPopulation> > _populations;
-	size_t getUserType(double stack) const;
+//Группы пользователей по размеру стека: группа - число границ, меньших стека, размер стека
+//в группе приводится к ее нижней границе (min для группы 0). Границы user.stackGroupBorders -
+//_0, _1, ... по возрастанию или bands групп с границами в геометрической прогрессии от min до max
+//(полосы хвоста Парето). Классификация - бинарный поиск без ветвлений: на пути каждой сессии.
+class StackGroups
+{
+	std::vector<double> _borders;
+	double _min;
 public:
-	StratEnvironment(const std::string& src, bool loadFromFile);
-	std::shared_ptr<Strat>& pick(double stack, double skill){return _populations[getUserType(stack)]->pick();};
+	StackGroups() : _min(0.0){};
+	void init(const std::string& path);
+	size_t size()const {return _borders.size() + 1;};
+	size_t classify(double stack)const
+	{
+		const double* base = _borders.data();
+		size_t len = _borders.size();
+		if(!len)
+			return 0;
+		while(len > 1)
+		{
+			size_t half = len / 2;
+			base = (base[half] < stack) ? (base + half) : base;
+			len -= half;
+		}
+		return static_cast<size_t>(base - _borders.data()) + ((*base < stack) ? 1 : 0);
+	};
+	double getFloor(size_t group)const {return group ? _borders[group - 1] : _min;};
+};
+
+class StratEnvironment
+{
+	StackGroups _stackGroups;
+
+	std::unique_ptr<boost::asio::thread_pool> _pool;//эволюция популяций, объявлен до популяций
+	//Популяция на группу стека. С user.stackGroupBorders lazy популяция создается при первом
+	//pick в группе (реплики окружения могут прийти в нее одновременно) из своего потока Rnd,
+	//а настройки, розданные популяциям до этого, применяются к ней при создании.
+	std::vector<std::unique_ptr<StratPopulation> > _populations;//nullptr - еще не создана
+	std::vector<std::atomic<StratPopulation*> > _active;
+	std::mutex _createMutex;
+	uint64_t _lazySeed;
+	bool _deferEvolution;
+	IslandChannel* _islands;
+	std::pair<size_t, size_t> _islandIndex;//число островов, остров
+	GenerationLog* _log;
+	StratPopulation* create(size_t group);
+	//начальные стратегии группы из strat.init на собственном потоке генератора
+	void initFresh(size_t group, StratPopulation& population)const;
+	void setup(size_t group, StratPopulation& population)const;
+public:
+	StratEnvironment() : _lazySeed(0), _deferEvolution(false), _islands(nullptr), _islandIndex(0, 0), _log(nullptr){};
+	void init(const std::string& src, bool loadFromFile);
+	StratRef pick(size_t group, double skill)
+	{
+		StratPopulation* population = _active[group].load(std::memory_order_acquire);
+		if(!population)
+			population = create(group);
+		StratRef ret{population};
+		ret.slot = population->pick(ret.scenario, ret.cycle);
+		return ret;
+	};
 	void sendTo(std::unique_ptr<ProjectedDataRepresentation>& representation)const;
 	void updateProbsRepresentation(std::unique_ptr<ProjectedDataRepresentation>& representation)const;
 	size_t size()const{return _populations.size();};
-	void print(std::ofstream& file)const;
-	size_t getStackGroupsNum()const{return (_stackBorders.size() + 1);};
-	double fixStackSize(double val) const;
+	size_t getActiveNum()const;//созданные популяции
+	void snapshot(PopulationArchive::Layout& layout, std::vector<double>& genes)const;
+	double getMeanUtility()const;
+	Squelch<StratMatrix>::FitStats getFitStats();
+	//популяция p острова island шлет в кольцо (island + 1) * size() + p и читает свое island * size() + p
+	void joinIslands(IslandChannel* channel, size_t islandsNum, size_t island);
+	void setGenerationLog(GenerationLog* log);
+	std::pair<size_t, size_t> getMigrantsNum()const;
+	StratPopulation::ScenarioVariance getScenarioVariance()const;
+	std::pair<size_t, size_t> getArchiveSeeds()const;
+	//шаги с отбором суррогатом, все шаги, средние по популяциям корреляция и ошибка предсказаний
+	std::array<double, 4> getSurrogateStats()const;
+	ClanDiversity::Stats getDiversity()const;//среднее по популяциям
+	void setDeferEvolution(bool defer);
+	void sync();
+	size_t getStackGroupsNum()const{return _stackGroups.size();};
+	size_t getStackGroup(double stack)const {return _stackGroups.classify(stack);};
+	double getStackFloor(size_t group)const {return _stackGroups.getFloor(group);};
 };
 
 class User final
 {
-	static size_t s_maxPasses;
-	static double s_articleRatingLnFactor;
-	static double s_articlePassesLnFactor;
-	static double s_initCharge;
-	static double s_straightforwardFactorPower;
+	static thread_local size_t s_maxPasses;
+	static thread_local double s_articleRatingLnFactor;
+	static thread_local double s_articlePassesLnFactor;
+	static thread_local double s_initCharge;
+	static thread_local double s_straightforwardFactorPower;
 	double getTotalUtility(const GlobalProps& globalProps)const;
+	double getFeature(Strat::FeatureType featureType, const Article& article)const;
+	template<Strat::ActType actType>
+	Strat::Features<actType> getFeatures(const Article& article)const;
 	double _charge;
 	std::unique_ptr<RndVariable> _stack;
 	Article::TextProperties _taste;
 	double _fixedUtility;
-	std::shared_ptr<Strat> _strat;
+	StratRef _strat;
+	//с population.crn случайные величины прогона берутся из сценария клана стратегии
+	mutable std::mt19937 _scenarioStream;
+	std::mt19937* getScenarioStream()const
+		{return (static_cast<bool>(_strat) && StratPopulation::isCommonScenarios()) ? &_scenarioStream : nullptr;};
 	std::list<std::pair<std::weak_ptr<Article>, std::weak_ptr<Vote> > > _votes;
 	size_t _curPass;
 
 public:
+	static void loadSettings();
 	User();
 	std::shared_ptr<Article> pickArticle(std::vector<std::shared_ptr<Article> >& articles, std::vector<double>& buf) const;
 	double getVoteWeight(const std::shared_ptr<Article>& article); //_charge is changing here
@@ -347,20 +853,71 @@ public:
 
 class Environment final
 {
-	static bool s_displayEnable;
+public:
+	using Metrics = std::map<std::string, double>;
+	static constexpr unsigned VERSION = 3;//увеличивать при изменениях, влияющих на результаты моделирования
+private:
+	static thread_local bool s_displayEnable;
+	std::shared_ptr<const Settings> _settings;
+	std::unique_ptr<IslandChannel> _islands;//популяции держат указатель, объявлен до них
+	std::unique_ptr<GenerationLog> _history;//report.history, тоже объявлен до популяций
 	StratEnvironment _strats;
 	std::string _resultFileName;
-	GlobalProps _globalProps;
+	bool _binaryReport;
+	Metrics _metrics;
+	std::unique_ptr<PopulationWriter> _writer;
+	PopulationWriter::Snapshot _saveBuffer;
+	double _saveSnapshotSeconds;
+	double _saveStallSeconds;
+	//средняя полезность каждые report.convergence period проходов - для числа проходов до сходимости
+	struct TracePoint
+	{
+		size_t pass;
+		double utility;
+		double diversity;//среднее расстояние между членами кланов
+	};
+	std::vector<TracePoint> _utilityTrace;
+	void traceUtility(size_t prevPass, size_t pass, size_t period);
+	void addConvergenceMetrics(double tolerance);
 	static std::unique_ptr<ProjectedDataRepresentation> makeRepresentation(const std::string& path, const std::string& name, size_t rowSize = 0);
 	std::unique_ptr<ProjectedDataRepresentation> _stratRepresentation;
 	std::unique_ptr<ProjectedDataRepresentation> _probsRepresentation;
-	void save()const;
+	//Статьи, пользователи и общие величины одного мира. При environment replicas > 1 миры
+	//считаются в своих потоках эпохами по replicaEpoch проходов над общими популяциями,
+	//наблюдения полезности копятся в журналах и применяются между эпохами вместе с эволюцией.
+	struct Replica
+	{
+		std::vector<std::shared_ptr<Article> > articles;
+		std::vector<std::shared_ptr<User> > users;
+		std::vector<double> bufArticlesWeights;
+		size_t curArticle = 0;
+		size_t curUser = 0;
+		GlobalProps globalProps;
+		std::unique_ptr<Rules> rules;//Func не потокобезопасен, у каждой реплики свои
+		std::vector<StratPopulation::Observation> observations;
+		unsigned seed = 0;
+		std::exception_ptr error;
+		Replica(size_t articlesNum, size_t usersNum, const std::string& rulesAttrPath);
+	};
+	void pass(Replica& replica, size_t pass, size_t articlesPeriod, size_t displayPeriod);
+	void show(size_t pass, std::chrono::milliseconds startTime);
+	void save();
+	static void loadSettings();//обновляет закэшированные в static thread_local членах параметры текущей конфигурации
 #ifdef VERBOSE_MODE
-	void print(std::shared_ptr<User>& user, const std::shared_ptr<Article>& article, const std::string& name)const;
+	void print(const GlobalProps& globalProps, std::shared_ptr<User>& user, const std::shared_ptr<Article>& article, const std::string& name)const;
 #endif
 public:
-	Environment(const std::string& resultFileName, const std::string& srcFileName = std::string());
+	Environment(const std::shared_ptr<const Settings>& settings,
+			const std::string& resultFileName, const std::string& srcFileName = std::string());
+	//подключает окружение островом island к каналу channelName из islandsNum островов, до run()
+	void joinIslands(const std::string& channelName, size_t islandsNum, size_t island);
 	void run(const std::string& rulesAttrPath);
+	const Metrics& getMetrics()const {return _metrics;};
+	static std::string getSettingsFileName(const std::string& resultFileName);
+	static std::string getIslandFileName(const std::string& resultFileName, size_t island);
+	static std::string getHistoryFileName(const std::string& resultFileName);
+	//версия модели вместе с политикой вычислений StratMath - от обеих зависят результаты
+	static std::string getVersion() {return std::to_string(VERSION) + "-" + StratMath::NAME;};
 };
 
 
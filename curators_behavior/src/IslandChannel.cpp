@@ -0,0 +1,116 @@
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "IslandChannel.h"
+
+IslandChannel::IslandChannel(const std::string& name, size_t ringsNum, size_t capacity, size_t recordSize) :
+		_name(name), _ringsNum(ringsNum), _capacity(capacity), _recordSize(recordSize), _size(0),
+		_data(nullptr), _header(nullptr), _rings(nullptr), _records(nullptr)
+{
+	if(!ringsNum || !capacity || !recordSize)
+		throw std::runtime_error("IslandChannel: empty channel");
+	_size = HEADER_SIZE + (ringsNum * sizeof(Ring)) + (ringsNum * capacity * recordSize * sizeof(double));
+
+	//размер задает только создатель сегмента: подключившийся не меняет сегмент, уже отображенный другими
+	bool created = true;
+	int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+	if((fd < 0) && (errno == EEXIST))
+	{
+		created = false;
+		fd = shm_open(name.c_str(), O_RDWR, 0600);
+	}
+	if(fd < 0)
+		throw std::runtime_error(std::string("IslandChannel: can't open shared memory: ") + name);
+	if(created && ftruncate(fd, static_cast<off_t>(_size)))
+	{
+		close(fd);
+		shm_unlink(name.c_str());
+		throw std::runtime_error(std::string("IslandChannel: can't resize shared memory: ") + name);
+	}
+	if(!created)
+	{
+		//создатель мог еще не задать размер
+		struct stat st;
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+		while(!fstat(fd, &st) && !st.st_size && (std::chrono::steady_clock::now() < deadline))
+			std::this_thread::yield();
+		if(fstat(fd, &st) || (static_cast<size_t>(st.st_size) != _size))
+		{
+			close(fd);
+			throw std::runtime_error(std::string("IslandChannel: different channel layout: ") + name);
+		}
+	}
+	_data = mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(_data == MAP_FAILED)
+	{
+		_data = nullptr;
+		throw std::runtime_error(std::string("IslandChannel: can't map shared memory: ") + name);
+	}
+	_header = static_cast<Header*>(_data);
+	_rings = reinterpret_cast<Ring*>(static_cast<char*>(_data) + HEADER_SIZE);
+	_records = reinterpret_cast<double*>(_rings + ringsNum);
+
+	uint32_t state = 0;
+	if(_header->state.compare_exchange_strong(state, 1))
+	{
+		_header->ringsNum = static_cast<uint32_t>(ringsNum);
+		_header->capacity = static_cast<uint32_t>(capacity);
+		_header->recordSize = static_cast<uint32_t>(recordSize);
+		_header->state.store(2, std::memory_order_release);
+	}
+	else
+	{
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+		while(_header->state.load(std::memory_order_acquire) != 2)
+		{
+			if(std::chrono::steady_clock::now() > deadline)
+			{
+				munmap(_data, _size);
+				throw std::runtime_error(std::string("IslandChannel: shared memory is not initialized: ") + name);
+			}
+			std::this_thread::yield();
+		}
+	}
+	if((_header->ringsNum != ringsNum) || (_header->capacity != capacity) || (_header->recordSize != recordSize))
+	{
+		munmap(_data, _size);
+		throw std::runtime_error(std::string("IslandChannel: different channel layout: ") + name);
+	}
+	_header->attached.fetch_add(1);
+}
+
+IslandChannel::~IslandChannel()
+{
+	if(_header->attached.fetch_sub(1) == 1)
+		shm_unlink(_name.c_str());
+	munmap(_data, _size);
+}
+
+bool IslandChannel::push(size_t ring, const double* record)
+{
+	Ring& r = _rings[ring];
+	uint64_t tail = r.tail.load(std::memory_order_relaxed);
+	if((tail - r.head.load(std::memory_order_acquire)) >= _capacity)
+		return false;
+	std::memcpy(getRecord(ring, tail), record, _recordSize * sizeof(double));
+	r.tail.store(tail + 1, std::memory_order_release);
+	return true;
+}
+
+bool IslandChannel::pop(size_t ring, double* record)
+{
+	Ring& r = _rings[ring];
+	uint64_t head = r.head.load(std::memory_order_relaxed);
+	if(head == r.tail.load(std::memory_order_acquire))
+		return false;
+	std::memcpy(record, getRecord(ring, head), _recordSize * sizeof(double));
+	r.head.store(head + 1, std::memory_order_release);
+	return true;
+}
@@ -0,0 +1,61 @@
+#ifndef ISLANDCHANNEL_H_
+#define ISLANDCHANNEL_H_
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+//Обмен мигрантами между островами (репликами Environment в потоках или процессах)
+//через разделяемую память POSIX. Сегмент - набор колец фиксированной емкости
+//с записями по recordSize double; в каждое кольцо пишет один остров и читает один,
+//поэтому хватает двух атомарных счетчиков без блокировок.
+//Сегмент создает и задает ему размер первый подключившийся, удаляет последний отключившийся;
+//остров с другой раскладкой канала получает ошибку, не трогая сегмент.
+//Упавший остров не отключается: сегмент с постоянным именем (population.islands channel)
+//остается с его счетчиком и недочитанными записями, перед новым запуском его нужно удалить
+//(shm_unlink, в Linux - файл /dev/shm/<имя>).
+class IslandChannel
+{
+	struct Header
+	{
+		std::atomic<uint32_t> state;//0 - пустой, 1 - инициализируется, 2 - готов
+		std::atomic<uint32_t> attached;
+		uint32_t ringsNum;
+		uint32_t capacity;
+		uint32_t recordSize;
+	};
+	struct Ring
+	{
+		alignas(64) std::atomic<uint64_t> head;//читатель
+		alignas(64) std::atomic<uint64_t> tail;//писатель
+	};
+	static_assert(std::atomic<uint64_t>::is_always_lock_free, "IslandChannel: atomics must be lock-free");
+	static constexpr size_t HEADER_SIZE = 64;
+
+	std::string _name;
+	size_t _ringsNum;
+	size_t _capacity;
+	size_t _recordSize;
+	size_t _size;
+	void* _data;
+	Header* _header;
+	Ring* _rings;
+	double* _records;
+
+	double* getRecord(size_t ring, uint64_t pos) {return _records + (((ring * _capacity) + (pos % _capacity)) * _recordSize);};
+
+public:
+	IslandChannel(const std::string& name, size_t ringsNum, size_t capacity, size_t recordSize);
+	~IslandChannel();
+	IslandChannel(IslandChannel const&) = delete;
+	void operator=(IslandChannel const&) = delete;
+
+	//false - кольцо заполнено, запись теряется
+	bool push(size_t ring, const double* record);
+	//false - кольцо пусто
+	bool pop(size_t ring, double* record);
+
+	size_t getRecordSize()const {return _recordSize;};
+	const std::string& getName()const {return _name;};
+};
+
+#endif /* ISLANDCHANNEL_H_ */
@@ -0,0 +1,197 @@
+#include <cstring>
+#include <fstream>
+#include <numeric>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "PopulationArchive.h"
+
+constexpr char PopulationArchive::MAGIC[4];
+constexpr uint32_t PopulationArchive::VERSION;
+
+namespace
+{
+	bool littleEndianHost()
+	{
+		const uint16_t probe = 1;
+		return *reinterpret_cast<const uint8_t*>(&probe) == 1;
+	}
+
+	template<class T>
+	void put(std::vector<char>& buf, T val)
+	{
+		const char* p = reinterpret_cast<const char*>(&val);
+		buf.insert(buf.end(), p, p + sizeof(T));
+	}
+
+	template<class T>
+	T take(const char* data, size_t size, size_t& pos)
+	{
+		if(pos + sizeof(T) > size)
+			throw std::runtime_error("PopulationArchive: unexpected end of file");
+		T ret;
+		std::memcpy(&ret, data + pos, sizeof(T));
+		pos += sizeof(T);
+		return ret;
+	}
+};
+
+size_t PopulationArchive::Layout::getGenesNum()const
+{
+	size_t ret = 0;
+	for(auto s : phenosizes)
+		ret += 1 + (2 * s);//displ, (factor, bend) на каждый признак
+	return ret;
+}
+
+size_t PopulationArchive::Layout::getStratsNum()const
+{
+	size_t ret = 0;
+	for(const auto& population : clans)
+		ret += std::accumulate(population.begin(), population.end(), static_cast<size_t>(0));
+	return ret;
+}
+
+void PopulationArchive::write(const std::string& fileName, const Layout& layout, const std::vector<double>& genes)
+{
+	if(!littleEndianHost())
+		throw std::runtime_error("PopulationArchive::write: big-endian hosts are not supported");
+	size_t featuresNum = std::accumulate(layout.phenosizes.begin(), layout.phenosizes.end(), static_cast<size_t>(0));
+	if(layout.featureTypes.size() != featuresNum)
+		throw std::logic_error("PopulationArchive::write: wrong size of feature types");
+	size_t stratsNum = layout.getStratsNum();
+	if(genes.size() != stratsNum * layout.getGenesNum())
+		throw std::logic_error("PopulationArchive::write: wrong size of genome matrix");
+
+	size_t clansTotal = 0;
+	for(const auto& population : layout.clans)
+		clansTotal += population.size();
+
+	std::vector<char> head;
+	head.insert(head.end(), MAGIC, MAGIC + sizeof(MAGIC));
+	put<uint32_t>(head, VERSION);
+	put<uint64_t>(head, layout.settingsHash);
+	put<uint32_t>(head, layout.phenosizes.size());
+	put<uint32_t>(head, featuresNum);
+	put<uint32_t>(head, layout.clans.size());
+	put<uint32_t>(head, clansTotal);
+	put<uint64_t>(head, stratsNum);
+	size_t offsetPos = head.size();
+	put<uint64_t>(head, 0);
+	for(auto s : layout.phenosizes)
+		put<uint32_t>(head, s);
+	for(auto t : layout.featureTypes)
+		put<uint32_t>(head, t);
+	for(const auto& population : layout.clans)
+		put<uint32_t>(head, population.size());
+	for(const auto& population : layout.clans)
+		for(auto s : population)
+			put<uint32_t>(head, s);
+	head.resize((head.size() + 7) & ~static_cast<size_t>(7), 0);
+	uint64_t matrixOffset = head.size();
+	std::memcpy(head.data() + offsetPos, &matrixOffset, sizeof(matrixOffset));
+
+	std::ofstream file(fileName, std::ios::binary | std::ios::trunc);
+	if(!file)
+		throw std::runtime_error(std::string("PopulationArchive::write: can't open file: ") + fileName);
+	file.write(head.data(), head.size());
+	file.write(reinterpret_cast<const char*>(genes.data()), genes.size() * sizeof(double));
+	if(!file)
+		throw std::runtime_error(std::string("PopulationArchive::write: can't write file: ") + fileName);
+}
+
+bool PopulationArchive::check(const std::string& fileName)
+{
+	std::ifstream file(fileName, std::ios::binary);
+	char magic[sizeof(MAGIC)] = {};
+	return file.read(magic, sizeof(magic)) && !std::memcmp(magic, MAGIC, sizeof(MAGIC));
+}
+
+PopulationArchive::PopulationArchive(const std::string& fileName) : _genesNum(0), _data(nullptr), _size(0), _genes(nullptr)
+{
+	if(!littleEndianHost())
+		throw std::runtime_error("PopulationArchive: big-endian hosts are not supported");
+	int fd = open(fileName.c_str(), O_RDONLY);
+	if(fd < 0)
+		throw std::runtime_error(std::string("PopulationArchive: can't open file: ") + fileName);
+	struct stat st;
+	if(fstat(fd, &st) || (st.st_size <= 0))
+	{
+		close(fd);
+		throw std::runtime_error(std::string("PopulationArchive: can't stat file: ") + fileName);
+	}
+	_size = static_cast<size_t>(st.st_size);
+	_data = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(_data == MAP_FAILED)
+	{
+		_data = nullptr;
+		throw std::runtime_error(std::string("PopulationArchive: can't map file: ") + fileName);
+	}
+
+	try
+	{
+		const char* data = static_cast<const char*>(_data);
+		size_t pos = 0;
+		if((_size < sizeof(MAGIC)) || std::memcmp(data, MAGIC, sizeof(MAGIC)))
+			throw std::runtime_error(std::string("PopulationArchive: wrong magic: ") + fileName);
+		pos += sizeof(MAGIC);
+		if(take<uint32_t>(data, _size, pos) != VERSION)
+			throw std::runtime_error(std::string("PopulationArchive: unsupported version: ") + fileName);
+		_layout.settingsHash = take<uint64_t>(data, _size, pos);
+		uint32_t actsNum = take<uint32_t>(data, _size, pos);
+		uint32_t featuresNum = take<uint32_t>(data, _size, pos);
+		uint32_t populationsNum = take<uint32_t>(data, _size, pos);
+		uint32_t clansTotal = take<uint32_t>(data, _size, pos);
+		uint64_t stratsTotal = take<uint64_t>(data, _size, pos);
+		uint64_t matrixOffset = take<uint64_t>(data, _size, pos);
+
+		_layout.phenosizes.resize(actsNum);
+		for(auto& s : _layout.phenosizes)
+			s = take<uint32_t>(data, _size, pos);
+		_layout.featureTypes.resize(featuresNum);
+		for(auto& t : _layout.featureTypes)
+			t = take<uint32_t>(data, _size, pos);
+		_layout.clans.resize(populationsNum);
+		for(auto& population : _layout.clans)
+			population.resize(take<uint32_t>(data, _size, pos));
+		size_t row = 0;
+		size_t clansRead = 0;
+		_clanOffsets.resize(populationsNum);
+		for(size_t p = 0; p < populationsNum; p++)
+			for(auto& s : _layout.clans[p])
+			{
+				s = take<uint32_t>(data, _size, pos);
+				_clanOffsets[p].push_back(row);
+				row += s;
+				++clansRead;
+			}
+		if((clansRead != clansTotal) || (row != stratsTotal))
+			throw std::runtime_error(std::string("PopulationArchive: inconsistent layout: ") + fileName);
+		_genesNum = _layout.getGenesNum();
+		if((matrixOffset % sizeof(double)) || (matrixOffset < pos) ||
+				(matrixOffset + (stratsTotal * _genesNum * sizeof(double)) > _size))
+			throw std::runtime_error(std::string("PopulationArchive: wrong genome matrix bounds: ") + fileName);
+		_genes = reinterpret_cast<const double*>(data + matrixOffset);
+	}
+	catch(...)
+	{
+		munmap(_data, _size);
+		throw;
+	}
+}
+
+PopulationArchive::~PopulationArchive()
+{
+	if(_data)
+		munmap(_data, _size);
+}
+
+const double* PopulationArchive::getGenes(size_t population, size_t clan, size_t strat)const
+{
+	if(strat >= getStratsNum(population, clan))
+		throw std::out_of_range("PopulationArchive::getGenes: wrong strat index");
+	return _genes + ((_clanOffsets[population][clan] + strat) * _genesNum);
+}
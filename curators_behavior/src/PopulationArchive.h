@@ -0,0 +1,53 @@
+#ifndef POPULATIONARCHIVE_H_
+#define POPULATIONARCHIVE_H_
+#include <cstdint>
+#include <string>
+#include <vector>
+
+//Бинарный (little-endian) архив популяций:
+//  заголовок, размеры фенотипов и типы признаков,
+//  число кланов в каждой популяции, число стратегий в каждом клане,
+//  матрица геномов stratsTotal x genesNum (double, выровнена на 8 байт).
+//Чтение идет через mmap, гены отдаются указателями прямо в отображенную память.
+class PopulationArchive
+{
+public:
+	static constexpr char MAGIC[4] = {'G', 'P', 'O', 'P'};
+	static constexpr uint32_t VERSION = 1;
+
+	struct Layout
+	{
+		std::vector<uint32_t> phenosizes;
+		std::vector<uint32_t> featureTypes;//по всем признакам всех фенотипов
+		std::vector<std::vector<uint32_t> > clans;//clans[population][clan] - число стратегий
+		uint64_t settingsHash = 0;
+		size_t getGenesNum()const;
+		size_t getStratsNum()const;
+	};
+
+private:
+	Layout _layout;
+	size_t _genesNum;
+	void* _data;
+	size_t _size;
+	const double* _genes;
+	std::vector<std::vector<size_t> > _clanOffsets;//номер первой строки клана в матрице
+
+public:
+	explicit PopulationArchive(const std::string& fileName);
+	~PopulationArchive();
+	PopulationArchive(PopulationArchive const&) = delete;
+	void operator=(PopulationArchive const&) = delete;
+
+	static bool check(const std::string& fileName);//true, если файл - бинарный архив
+	static void write(const std::string& fileName, const Layout& layout, const std::vector<double>& genes);
+
+	const Layout& getLayout()const {return _layout;};
+	size_t getPopulationsNum()const {return _layout.clans.size();};
+	size_t getClansNum(size_t population)const {return _layout.clans.at(population).size();};
+	size_t getStratsNum(size_t population, size_t clan)const {return _layout.clans.at(population).at(clan);};
+	const double* getGenes(size_t population, size_t clan, size_t strat)const;
+	const double* getGenes()const {return _genes;};//вся матрица
+};
+
+#endif /* POPULATIONARCHIVE_H_ */
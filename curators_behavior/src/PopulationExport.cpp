@@ -0,0 +1,42 @@
+#include <iostream>
+#include <string>
+#include "GenerationLog.h"
+#include "PopulationArchive.h"
+#include "PopulationWriter.h"
+
+//Конвертирует бинарный архив популяций (*.pop) или поколение из журнала поколений (*.glog)
+//в xml, который понимает StratEnvironment и который удобно читать глазами:
+//  PopulationExport input.pop output.xml
+//  PopulationExport input.glog generation output.xml
+//Популяции, у которых записей меньше generation + 1, берутся в последнем записанном поколении.
+int main(int argc, char* argv[])
+{
+	if((argc != 3) && (argc != 4))
+	{
+		std::cerr << "usage: " << argv[0] << " input.pop output.xml" << std::endl;
+		std::cerr << "       " << argv[0] << " input.glog generation output.xml" << std::endl;
+		return 1;
+	}
+	try
+	{
+		if(argc == 3)
+		{
+			PopulationArchive archive(argv[1]);
+			PopulationWriter::writeXml(argv[2], archive.getLayout(), archive.getGenes());
+		}
+		else
+		{
+			GenerationLogReader log(argv[1]);
+			PopulationArchive::Layout layout;
+			std::vector<double> genes;
+			log.snapshot(std::stoull(argv[2]), layout, genes);
+			PopulationWriter::writeXml(argv[3], layout, genes.data());
+		}
+	}
+	catch(const std::exception& e)
+	{
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
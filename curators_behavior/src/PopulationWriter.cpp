@@ -0,0 +1,156 @@
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include "GolosEconomy.h"
+#include "PopulationWriter.h"
+
+void PopulationWriter::Snapshot::clear()
+{
+	layout.phenosizes.clear();
+	layout.featureTypes.clear();
+	layout.clans.clear();
+	layout.settingsHash = 0;
+	genes.clear();
+}
+
+PopulationWriter::PopulationWriter() :
+	_hasPending(false), _busy(false), _stop(false), _writeSeconds(0.0),
+	_thread(&PopulationWriter::loop, this){}
+
+PopulationWriter::~PopulationWriter()
+{
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		_stop = true;
+	}
+	_cv.notify_all();
+	_thread.join();
+}
+
+void PopulationWriter::loop()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	while(true)
+	{
+		_cv.wait(lock, [this](){return _hasPending || _stop;});
+		if(!_hasPending)
+			return;
+		std::swap(_pending, _writing);
+		_hasPending = false;
+		_busy = true;
+		lock.unlock();
+		_cv.notify_all();
+
+		auto startTime = std::chrono::steady_clock::now();
+		std::exception_ptr error;
+		try
+		{
+			write(_writing);
+		}
+		catch(...)
+		{
+			error = std::current_exception();
+		}
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - startTime;
+
+		lock.lock();
+		_writeSeconds += elapsed.count();
+		if(error && !_error)
+			_error = error;
+		_busy = false;
+		_cv.notify_all();
+	}
+}
+
+void PopulationWriter::rethrow()
+{
+	if(_error)
+	{
+		auto error = _error;
+		_error = nullptr;
+		std::rethrow_exception(error);
+	}
+}
+
+double PopulationWriter::submit(Snapshot& snapshot)
+{
+	auto startTime = std::chrono::steady_clock::now();
+	std::unique_lock<std::mutex> lock(_mutex);
+	_cv.wait(lock, [this](){return !_hasPending;});
+	std::chrono::duration<double> stall = std::chrono::steady_clock::now() - startTime;
+	rethrow();
+	std::swap(snapshot, _pending);
+	_hasPending = true;
+	lock.unlock();
+	_cv.notify_all();
+	return stall.count();
+}
+
+void PopulationWriter::flush()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	_cv.wait(lock, [this](){return !_hasPending && !_busy;});
+	rethrow();
+}
+
+double PopulationWriter::getWriteSeconds()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	return _writeSeconds;
+}
+
+void PopulationWriter::write(const Snapshot& snapshot)
+{
+	std::string tmpFileName = snapshot.fileName + ".tmp";
+	if(snapshot.binary)
+		PopulationArchive::write(tmpFileName, snapshot.layout, snapshot.genes);
+	else
+		writeXml(tmpFileName, snapshot.layout, snapshot.genes.data());
+	if(std::rename(tmpFileName.c_str(), snapshot.fileName.c_str()))
+		throw std::runtime_error(std::string("PopulationWriter::write: can't rename to ") + snapshot.fileName);
+}
+
+void PopulationWriter::writeXml(const std::string& fileName, const PopulationArchive::Layout& layout, const double* genes)
+{
+	std::vector<Strat::FeatureType> featureTypes;
+	for(auto t : layout.featureTypes)
+	{
+		if(t >= static_cast<uint32_t>(Strat::FeatureType::UNDEF))
+			throw std::runtime_error("PopulationWriter::writeXml: unknown feature type");
+		featureTypes.push_back(static_cast<Strat::FeatureType>(t));
+	}
+	Strat::checkSchema(featureTypes);
+	if(!std::equal(layout.phenosizes.begin(), layout.phenosizes.end(),
+			Strat::PHENOSIZES.begin(), Strat::PHENOSIZES.end()))
+		throw std::runtime_error("PopulationWriter::writeXml: different phenotypes");
+
+	std::ofstream file(fileName);
+	if(!file)
+		throw std::runtime_error(std::string("PopulationWriter::writeXml: can't open file: ") + fileName);
+	std::ostringstream hash;
+	hash << std::hex << std::setw(16) << std::setfill('0') << layout.settingsHash;
+	file << "<?xml version=\"1.0\"?>\n";
+	file << "<stratEnvironment settingsHash=\"" << hash.str() << "\">\n";
+	for(size_t p = 0; p < layout.clans.size(); p++)
+	{
+		std::string populationName = std::string("population_") + std::to_string(p);
+		file << "<" << populationName << ">\n";
+		for(size_t c = 0; c < layout.clans[p].size(); c++)
+		{
+			std::string clanName = std::string("clan_") + std::to_string(c);
+			file << "<" << clanName << ">\n";
+			for(size_t s = 0; s < layout.clans[p][c]; s++)
+			{
+				Strat::print(genes, std::string("strat_") + std::to_string(s), file);
+				genes += Strat::getGenesNum();
+			}
+			file << "</" << clanName << ">\n";
+		}
+		file << "</" << populationName << ">\n";
+	}
+	file << "</stratEnvironment>\n";
+	if(!file)
+		throw std::runtime_error(std::string("PopulationWriter::writeXml: can't write file: ") + fileName);
+}
@@ -0,0 +1,57 @@
+#ifndef POPULATIONWRITER_H_
+#define POPULATIONWRITER_H_
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "PopulationArchive.h"
+
+//Фоновая запись снимков популяций. Моделирование заполняет свой буфер и
+//обменивает его с ожидающим записи (swap векторов, без выделения памяти),
+//поток записи пишет во временный файл и атомарно переименовывает его.
+//Ждать приходится только если предыдущий снимок еще не забран потоком записи.
+class PopulationWriter
+{
+public:
+	struct Snapshot
+	{
+		PopulationArchive::Layout layout;
+		std::vector<double> genes;
+		std::string fileName;
+		bool binary = true;
+		void clear();
+	};
+
+private:
+	Snapshot _pending;
+	Snapshot _writing;
+	bool _hasPending;
+	bool _busy;
+	bool _stop;
+	double _writeSeconds;
+	std::exception_ptr _error;
+	std::mutex _mutex;
+	std::condition_variable _cv;
+	std::thread _thread;
+	void loop();
+	void rethrow();
+
+public:
+	PopulationWriter();
+	~PopulationWriter();
+	PopulationWriter(PopulationWriter const&) = delete;
+	void operator=(PopulationWriter const&) = delete;
+
+	//забирает содержимое snapshot, взамен отдает буфер прошлого снимка;
+	//возвращает время ожидания потока записи в секундах
+	double submit(Snapshot& snapshot);
+	void flush();
+	double getWriteSeconds();//суммарное время записи в фоне
+
+	static void write(const Snapshot& snapshot);
+	static void writeXml(const std::string& fileName, const PopulationArchive::Layout& layout, const double* genes);
+};
+
+#endif /* POPULATIONWRITER_H_ */
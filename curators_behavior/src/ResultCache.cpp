@@ -0,0 +1,157 @@
+#include <cerrno>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <boost/filesystem.hpp>
+#include "ResultCache.h"
+
+ResultCache::ResultCache(const std::string& folder) : _folder(folder)
+{
+	if(enabled())
+		boost::filesystem::create_directories(_folder);
+}
+
+std::string ResultCache::makeKey(const Settings& settings, const std::string& rulePath, unsigned seed,
+		size_t copy, const std::string& inputFileName, const std::string& version)
+{
+	//main и display не влияют на результат моделирования
+	std::ostringstream key;
+	key << settings.hash({"main", "display"}) << "|" << rulePath << "|"
+			<< seed << "|" << copy << "|" << version;
+	if(!inputFileName.empty())
+	{
+		std::ifstream input(inputFileName, std::ios::binary);
+		if(!input)
+			throw std::runtime_error(std::string("ResultCache::makeKey: can't open file: ") + inputFileName);
+		std::ostringstream content;
+		content << input.rdbuf();
+		key << "|" << hashStr(content.str());
+	}
+	return hashStr(key.str());
+}
+
+bool ResultCache::find(const std::string& key, Entry& entry)const
+{
+	std::string folder = entryFolder(key);
+	std::ifstream metrics(folder + "/metrics.tsv");
+	if(!metrics)
+		return false;
+	entry.environmentFileName = folder + "/populations";
+	entry.metrics.clear();
+	std::string name;
+	double val;
+	while(metrics >> name >> val)
+		entry.metrics[name] = val;
+	return true;
+}
+
+bool ResultCache::held(const std::string& lockFileName)
+{
+	int fd = open(lockFileName.c_str(), O_RDONLY);
+	if(fd < 0)
+		return false;
+	bool ret = (flock(fd, LOCK_SH | LOCK_NB) != 0) && (errno == EWOULDBLOCK);
+	close(fd);
+	return ret;
+}
+
+bool ResultCache::lock(const std::string& key)const
+{
+	std::string fileName = lockFileName(key);
+	while(true)
+	{
+		int fd = open(fileName.c_str(), O_CREAT | O_RDWR, 0644);
+		if(fd < 0)
+			throw std::runtime_error(std::string("ResultCache::lock: can't create lock file: ") + fileName);
+		if(flock(fd, LOCK_EX | LOCK_NB) != 0)
+		{
+			bool busy = (errno == EWOULDBLOCK);
+			close(fd);
+			if(!busy)
+				throw std::runtime_error(std::string("ResultCache::lock: can't lock file: ") + fileName);
+			return false;
+		}
+		//прежний владелец мог удалить файл между open и flock: тогда блокировка взята
+		//на удаленном файле, и все повторяется с новым
+		struct stat opened;
+		struct stat current;
+		if((fstat(fd, &opened) == 0) && (stat(fileName.c_str(), &current) == 0) &&
+				(opened.st_ino == current.st_ino) && (opened.st_dev == current.st_dev))
+		{
+			//pid - только для отладки, владение определяет flock
+			std::string pid = std::to_string(getpid()) + "\n";
+			if((ftruncate(fd, 0) != 0) || (write(fd, pid.c_str(), pid.size()) != static_cast<ssize_t>(pid.size())))
+				std::cerr << "ResultCache::lock: can't write pid to " << fileName << std::endl;
+			std::lock_guard<std::mutex> lock(_locksMutex);
+			_locks[key] = fd;
+			return true;
+		}
+		close(fd);
+	}
+}
+
+void ResultCache::unlock(const std::string& key)const
+{
+	int fd = -1;
+	{
+		std::lock_guard<std::mutex> lock(_locksMutex);
+		auto it = _locks.find(key);
+		if(it == _locks.end())
+			return;
+		fd = it->second;
+		_locks.erase(it);
+	}
+	//файл удаляется, пока блокировка еще держится, - см. проверку inode в lock
+	unlink(lockFileName(key).c_str());
+	close(fd);
+}
+
+bool ResultCache::wait(const std::string& key, Entry& entry)const
+{
+	std::string fileName = lockFileName(key);
+	while(true)
+	{
+		if(find(key, entry))
+			return true;
+		if(!held(fileName))
+			return find(key, entry);
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+	}
+}
+
+void ResultCache::store(const std::string& key, const std::string& environmentFileName,
+		const std::string& settingsFileName, const Metrics& metrics)const
+{
+	std::ostringstream tmpName;
+	tmpName << entryFolder(key) << ".tmp." << getpid() << "." << std::this_thread::get_id();
+	boost::filesystem::path tmp(tmpName.str());
+	boost::filesystem::remove_all(tmp);
+	boost::filesystem::create_directories(tmp);
+	boost::filesystem::copy_file(environmentFileName, tmp / "populations");
+	if(!settingsFileName.empty() && boost::filesystem::exists(settingsFileName))
+		boost::filesystem::copy_file(settingsFileName, tmp / "settings.xml");
+	{
+		std::ofstream file((tmp / "metrics.tsv").string());
+		file.precision(17);
+		for(const auto& m : metrics)
+			file << m.first << "\t" << m.second << "\n";
+		if(!file)
+			throw std::runtime_error("ResultCache::store: can't write metrics");
+	}
+	//каталог появляется целиком или не появляется вовсе; если другой процесс
+	//успел опубликовать ту же запись, наша копия просто удаляется
+	if(rename(tmp.string().c_str(), entryFolder(key).c_str()))
+		boost::filesystem::remove_all(tmp);
+}
+
+void ResultCache::restore(const Entry& entry, const std::string& environmentFileName)
+{
+	boost::filesystem::copy_file(entry.environmentFileName, environmentFileName,
+			boost::filesystem::copy_option::overwrite_if_exists);
+}
@@ -0,0 +1,46 @@
+#ifndef RESULTCACHE_H_
+#define RESULTCACHE_H_
+#include <map>
+#include <mutex>
+#include <string>
+#include "Utils.h"
+
+//Локальное хранилище результатов Environment, адресуемое хэшем конфигурации.
+//Запись публикуется атомарным переименованием временного каталога, а
+//flock на lock-файле не дает нескольким процессам одной машины считать одну
+//и ту же конфигурацию одновременно; блокировку упавшего процесса снимает ядро.
+class ResultCache
+{
+public:
+	using Metrics = std::map<std::string, double>;
+	struct Entry
+	{
+		std::string environmentFileName;
+		Metrics metrics;
+	};
+
+private:
+	std::string _folder;
+	std::string entryFolder(const std::string& key)const {return _folder + "/" + key;};
+	std::string lockFileName(const std::string& key)const {return _folder + "/" + key + ".lock";};
+	mutable std::mutex _locksMutex;
+	mutable std::map<std::string, int> _locks;//взятые этим процессом блокировки: ключ - дескриптор
+	static bool held(const std::string& lockFileName);//true, если файл заблокирован живым процессом
+
+public:
+	explicit ResultCache(const std::string& folder = std::string());
+	bool enabled()const {return !_folder.empty();};
+	static std::string makeKey(const Settings& settings, const std::string& rulePath, unsigned seed,
+			size_t copy, const std::string& inputFileName, const std::string& version);
+
+	bool find(const std::string& key, Entry& entry)const;
+	bool lock(const std::string& key)const;//false, если конфигурацию уже считает живой процесс
+	void unlock(const std::string& key)const;
+	//ждет, пока владелец блокировки не опубликует запись или не завершится
+	bool wait(const std::string& key, Entry& entry)const;
+	void store(const std::string& key, const std::string& environmentFileName,
+			const std::string& settingsFileName, const Metrics& metrics)const;
+	static void restore(const Entry& entry, const std::string& environmentFileName);
+};
+
+#endif /* RESULTCACHE_H_ */
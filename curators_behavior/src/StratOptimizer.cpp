@@ -0,0 +1,350 @@
+#include <algorithm>
+#include <cmath>
+#include "StratOptimizer.h"
+#include "GolosEconomy.h"
+
+namespace
+{
+
+//выбор родителей среди выживших: равновероятно, турнир, линейное ранжирование
+class GeneticOptimizer final : public StratOptimizer
+{
+	enum class Selection{UNIFORM, TOURNAMENT, RANK};
+	Selection _selection;
+	size_t _tournamentSize;
+	double _rankPressure;//1 - равновероятно, 2 - худший выживший не размножается
+	size_t selectParent(const StratMatrix& strats, const std::vector<size_t>& clan, size_t firstSurv)const;
+public:
+	explicit GeneticOptimizer(const std::string& selectionPath);
+	void prepare(const StratMatrix& strats, std::vector<size_t>& members, size_t replaceNum, size_t clanNum) override;
+	void sample(const StratMatrix& strats, const std::vector<size_t>& members, size_t replaceNum,
+			size_t clanNum, double* genes, Parents& parents)const override;
+};
+
+//DE/rand/1/bin: мутант x_r1 + F (x_r2 - x_r3) по выжившим, биномиальное скрещивание
+//со случайным выжившим; пробный вектор сразу занимает слот проигравшего
+class DifferentialEvolution final : public StratOptimizer
+{
+	double _f;
+	double _cr;
+	double _limit;
+public:
+	explicit DifferentialEvolution(const std::string& path);
+	void sample(const StratMatrix& strats, const std::vector<size_t>& members, size_t replaceNum,
+			size_t clanNum, double* genes, Parents& parents)const override;
+};
+
+//CMA-ES по кланам: выжившие с весами по рангу сглаженной полезности - отобранные точки,
+//потомки - выборка N(mean, sigma^2 C). Элита переживает поколения, поэтому это (mu + lambda)-вариант;
+//вместо C^(-1/2) в пути шага используется обратный множитель Холецкого.
+class CmaEsOptimizer final : public StratOptimizer
+{
+	static constexpr size_t N = Strat::getGenesNum();
+	struct State
+	{
+		bool ready = false;
+		size_t generation = 0;
+		double sigma = 0.0;
+		std::vector<double> mean;
+		std::vector<double> c;//N x N по строкам
+		std::vector<double> l;//нижний треугольный, l l^T = c
+		std::vector<double> pc;
+		std::vector<double> ps;
+		std::vector<double> prevMean;
+		std::vector<double> weights;
+		std::vector<double> step;
+	};
+	double _sigma0;
+	double _limit;
+	std::vector<State> _states;
+	static bool cholesky(const std::vector<double>& c, std::vector<double>& l);
+	static void reset(State& state);
+public:
+	explicit CmaEsOptimizer(const std::string& path);
+	void init(size_t clansNum) override {_states.assign(clansNum, State());};
+	void prepare(const StratMatrix& strats, std::vector<size_t>& members, size_t replaceNum, size_t clanNum) override;
+	void sample(const StratMatrix& strats, const std::vector<size_t>& members, size_t replaceNum,
+			size_t clanNum, double* genes, Parents& parents)const override;
+};
+
+GeneticOptimizer::GeneticOptimizer(const std::string& selectionPath) :
+		_selection(Selection::UNIFORM), _tournamentSize(2), _rankPressure(1.5)
+{
+	if(Settings::exist(selectionPath, "type"))
+	{
+		std::string type(Settings::attribute(selectionPath, "type").as_string());
+		if(type == "tournament")
+			_selection = Selection::TOURNAMENT;
+		else if(type == "rank")
+			_selection = Selection::RANK;
+		else if(type != "uniform")
+			throw std::runtime_error("GeneticOptimizer::GeneticOptimizer: unknown selection type");
+	}
+	if(Settings::exist(selectionPath, "tournamentSize"))
+		_tournamentSize = Settings::attribute(selectionPath, "tournamentSize").as_uint();
+	if(Settings::exist(selectionPath, "rankPressure"))
+		_rankPressure = Settings::get(selectionPath, "rankPressure");
+	if(!_tournamentSize || (_rankPressure < 1.0) || (_rankPressure > 2.0))
+		throw std::runtime_error("GeneticOptimizer::GeneticOptimizer: wrong selection parameters");
+}
+
+void GeneticOptimizer::prepare(const StratMatrix& strats, std::vector<size_t>& members, size_t replaceNum, size_t)
+{
+	if(_selection == Selection::RANK)
+		std::sort(members.begin() + replaceNum, members.end(), [&strats](size_t lhs, size_t rhs){
+			return strats.getSmoothedUtility(lhs) < strats.getSmoothedUtility(rhs);});
+}
+
+void GeneticOptimizer::sample(const StratMatrix& strats, const std::vector<size_t>& members, size_t replaceNum,
+		size_t, double* genes, Parents& parents)const
+{
+	parents.second = members[selectParent(strats, members, replaceNum)];
+	parents.first = members[selectParent(strats, members, replaceNum)];
+	Strat::born(genes, strats.getGenes(parents.first), strats.getGenes(parents.second));
+}
+
+size_t GeneticOptimizer::selectParent(const StratMatrix& strats, const std::vector<size_t>& clan, size_t firstSurv)const
+{
+	size_t last = clan.size() - 1;
+	if(_selection == Selection::TOURNAMENT)
+	{
+		size_t ret = Rnd::choose(firstSurv, last);
+		for(size_t i = 1; i < _tournamentSize; i++)
+		{
+			size_t cur = Rnd::choose(firstSurv, last);
+			if(strats.getSmoothedUtility(clan[cur]) > strats.getSmoothedUtility(clan[ret]))
+				ret = cur;
+		}
+		return ret;
+	}
+	if(_selection == Selection::RANK)
+	{
+		//выжившие отсортированы по возрастанию, плотность по доле ранга t: (2 - p) + 2 (p - 1) t,
+		//t находим обращением функции распределения
+		double a = 2.0 - _rankPressure;
+		double b = 2.0 * (_rankPressure - 1.0);
+		double u = Rnd::uniform();
+		double t = (b > 0.0) ? ((std::sqrt((a * a) + (2.0 * b * u)) - a) / b) : u;
+		size_t survNum = clan.size() - firstSurv;
+		return firstSurv + std::min(static_cast<size_t>(t * static_cast<double>(survNum)), survNum - 1);
+	}
+	return Rnd::choose(firstSurv, last);
+}
+
+DifferentialEvolution::DifferentialEvolution(const std::string& path) :
+		_f(Settings::exist(path, "F") ? Settings::get(path, "F") : 0.5),
+		_cr(Settings::exist(path, "CR") ? Settings::get(path, "CR") : 0.9),
+		_limit(Settings::get("strat.breed", "limit"))
+{
+	if((_f <= 0.0) || (_cr < 0.0) || (_cr > 1.0))
+		throw std::runtime_error("DifferentialEvolution::DifferentialEvolution: wrong F or CR");
+}
+
+void DifferentialEvolution::sample(const StratMatrix& strats, const std::vector<size_t>& members, size_t replaceNum,
+		size_t, double* genes, Parents& parents)const
+{
+	const size_t genesNum = Strat::getGenesNum();
+	int last = static_cast<int>(members.size() - 1);
+	int first = (replaceNum < members.size()) ? static_cast<int>(replaceNum) : 0;
+	//при трех и более выживших r1, r2, r3 различны
+	std::array<size_t, 3> r;
+	for(size_t i = 0; i < r.size(); i++)
+	{
+		bool unique = false;
+		while(!unique)
+		{
+			r[i] = static_cast<size_t>(Rnd::choose(first, last));
+			unique = ((last - first) < 2) || (std::find(r.begin(), r.begin() + i, r[i]) == r.begin() + i);
+		}
+	}
+	const double* base = strats.getGenes(members[r[0]]);
+	const double* lhs = strats.getGenes(members[r[1]]);
+	const double* rhs = strats.getGenes(members[r[2]]);
+	parents.first = members[r[0]];
+	parents.second = members[Rnd::choose(first, last)];
+	const double* target = strats.getGenes(parents.second);
+	size_t forced = static_cast<size_t>(Rnd::choose(0, static_cast<int>(genesNum - 1)));
+	for(size_t g = 0; g < genesNum; g++)
+		genes[g] = ((g == forced) || (Rnd::uniform() < _cr)) ?
+				std::max(std::min(base[g] + (_f * (lhs[g] - rhs[g])), _limit), -_limit) : target[g];
+}
+
+CmaEsOptimizer::CmaEsOptimizer(const std::string& path) :
+		_sigma0(Settings::exist(path, "sigma") ? Settings::get(path, "sigma") : 1.0),
+		_limit(Settings::get("strat.breed", "limit"))
+{
+	if(_sigma0 <= 0.0)
+		throw std::runtime_error("CmaEsOptimizer::CmaEsOptimizer: sigma <= 0");
+}
+
+bool CmaEsOptimizer::cholesky(const std::vector<double>& c, std::vector<double>& l)
+{
+	std::fill(l.begin(), l.end(), 0.0);
+	for(size_t i = 0; i < N; i++)
+		for(size_t j = 0; j <= i; j++)
+		{
+			double sum = c[(i * N) + j];
+			for(size_t k = 0; k < j; k++)
+				sum -= l[(i * N) + k] * l[(j * N) + k];
+			if(i == j)
+			{
+				if(!(sum > 1.e-20))
+					return false;
+				l[(i * N) + i] = std::sqrt(sum);
+			}
+			else
+				l[(i * N) + j] = sum / l[(j * N) + j];
+		}
+	return true;
+}
+
+void CmaEsOptimizer::reset(State& state)
+{
+	state.c.assign(N * N, 0.0);
+	for(size_t i = 0; i < N; i++)
+		state.c[(i * N) + i] = 1.0;
+	state.l = state.c;
+	state.pc.assign(N, 0.0);
+	state.ps.assign(N, 0.0);
+}
+
+void CmaEsOptimizer::prepare(const StratMatrix& strats, std::vector<size_t>& members, size_t replaceNum, size_t clanNum)
+{
+	State& s = _states[clanNum];
+	if(replaceNum >= members.size())
+		return;
+	size_t mu = members.size() - replaceNum;
+	std::sort(members.begin() + replaceNum, members.end(), [&strats](size_t lhs, size_t rhs){
+		return strats.getSmoothedUtility(lhs) > strats.getSmoothedUtility(rhs);});
+
+	s.weights.resize(mu);
+	double sumW = 0.0;
+	for(size_t i = 0; i < mu; i++)
+	{
+		s.weights[i] = std::log(static_cast<double>(mu) + 0.5) - std::log(static_cast<double>(i) + 1.0);
+		sumW += s.weights[i];
+	}
+	double sumW2 = 0.0;
+	for(auto& w : s.weights)
+	{
+		w /= sumW;
+		sumW2 += w * w;
+	}
+	double muEff = 1.0 / sumW2;
+
+	s.prevMean = s.mean;
+	s.mean.assign(N, 0.0);
+	for(size_t i = 0; i < mu; i++)
+	{
+		const double* x = strats.getGenes(members[replaceNum + i]);
+		for(size_t g = 0; g < N; g++)
+			s.mean[g] += s.weights[i] * x[g];
+	}
+	if(!s.ready)
+	{
+		reset(s);
+		s.sigma = _sigma0;
+		s.generation = 0;
+		s.ready = true;
+		return;
+	}
+
+	const double n = static_cast<double>(N);
+	double cs = (muEff + 2.0) / (n + muEff + 5.0);
+	double ds = 1.0 + (2.0 * std::max(0.0, std::sqrt((muEff - 1.0) / (n + 1.0)) - 1.0)) + cs;
+	double cc = (4.0 + (muEff / n)) / (n + 4.0 + (2.0 * muEff / n));
+	double c1 = 2.0 / (((n + 1.3) * (n + 1.3)) + muEff);
+	double cmu = std::min(1.0 - c1, 2.0 * (muEff - 2.0 + (1.0 / muEff)) / (((n + 2.0) * (n + 2.0)) + muEff));
+	double chiN = std::sqrt(n) * (1.0 - (1.0 / (4.0 * n)) + (1.0 / (21.0 * n * n)));
+
+	s.step.resize(N);
+	for(size_t g = 0; g < N; g++)
+		s.step[g] = (s.mean[g] - s.prevMean[g]) / s.sigma;
+	//ps: L^(-1) step прямой подстановкой
+	double psNorm = 0.0;
+	double psFactor = std::sqrt(cs * (2.0 - cs) * muEff);
+	std::array<double, N> z;
+	for(size_t i = 0; i < N; i++)
+	{
+		double sum = s.step[i];
+		for(size_t k = 0; k < i; k++)
+			sum -= s.l[(i * N) + k] * z[k];
+		z[i] = sum / s.l[(i * N) + i];
+	}
+	for(size_t g = 0; g < N; g++)
+	{
+		s.ps[g] = ((1.0 - cs) * s.ps[g]) + (psFactor * z[g]);
+		psNorm += s.ps[g] * s.ps[g];
+	}
+	psNorm = std::sqrt(psNorm);
+	++s.generation;
+	double hsig = ((psNorm / std::sqrt(1.0 - std::pow(1.0 - cs, 2.0 * static_cast<double>(s.generation))) / chiN) <
+			(1.4 + (2.0 / (n + 1.0)))) ? 1.0 : 0.0;
+	double pcFactor = hsig * std::sqrt(cc * (2.0 - cc) * muEff);
+	for(size_t g = 0; g < N; g++)
+		s.pc[g] = ((1.0 - cc) * s.pc[g]) + (pcFactor * s.step[g]);
+
+	double keep = 1.0 - c1 - cmu + (c1 * (1.0 - hsig) * cc * (2.0 - cc));
+	for(size_t a = 0; a < N; a++)
+		for(size_t b = 0; b <= a; b++)
+			s.c[(a * N) + b] = (keep * s.c[(a * N) + b]) + (c1 * s.pc[a] * s.pc[b]);
+	for(size_t i = 0; i < mu; i++)
+	{
+		const double* x = strats.getGenes(members[replaceNum + i]);
+		double w = cmu * s.weights[i] / (s.sigma * s.sigma);
+		for(size_t a = 0; a < N; a++)
+		{
+			double ya = w * (x[a] - s.prevMean[a]);
+			for(size_t b = 0; b <= a; b++)
+				s.c[(a * N) + b] += ya * (x[b] - s.prevMean[b]);
+		}
+	}
+	for(size_t a = 0; a < N; a++)
+		for(size_t b = 0; b < a; b++)
+			s.c[(b * N) + a] = s.c[(a * N) + b];
+
+	s.sigma *= std::exp((cs / ds) * ((psNorm / chiN) - 1.0));
+	s.sigma = std::max(std::min(s.sigma, _limit), 1.e-10);
+	if(!cholesky(s.c, s.l))
+		reset(s);
+}
+
+void CmaEsOptimizer::sample(const StratMatrix& strats, const std::vector<size_t>& members, size_t,
+		size_t clanNum, double* genes, Parents& parents)const
+{
+	const State& s = _states[clanNum];
+	if(!s.ready)
+	{
+		//выживших нет - копия случайного члена клана
+		parents = Parents(members[Rnd::choose(0, static_cast<int>(members.size() - 1))], NO_PARENT);
+		const double* src = strats.getGenes(parents.first);
+		std::copy(src, src + N, genes);
+		return;
+	}
+	parents = Parents(NO_PARENT, NO_PARENT);
+	std::normal_distribution<double> dist(0.0, 1.0);
+	std::array<double, N> z;
+	for(auto& v : z)
+		v = dist(Rnd::engine());
+	for(size_t a = 0; a < N; a++)
+	{
+		double sum = 0.0;
+		for(size_t b = 0; b <= a; b++)
+			sum += s.l[(a * N) + b] * z[b];
+		genes[a] = std::max(std::min(s.mean[a] + (s.sigma * sum), _limit), -_limit);
+	}
+}
+
+}
+
+std::unique_ptr<StratOptimizer> StratOptimizer::make(const std::string& path)
+{
+	std::string type(Settings::exist(path, "type") ? Settings::attribute(path, "type").as_string() : "ga");
+	if(type == "ga")
+		return std::make_unique<GeneticOptimizer>("population.selection");
+	else if(type == "de")
+		return std::make_unique<DifferentialEvolution>(path);
+	else if(type == "cmaes")
+		return std::make_unique<CmaEsOptimizer>(path);
+	throw std::runtime_error(std::string("StratOptimizer::make: unknown optimizer type <") + type + ">");
+}
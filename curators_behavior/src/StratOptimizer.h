@@ -0,0 +1,31 @@
+#ifndef STRATOPTIMIZER_H_
+#define STRATOPTIMIZER_H_
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+class StratMatrix;
+
+//Алгоритм поиска новых геномов клана. StratPopulation::breed делит клан по сглаженной полезности:
+//members[0, replaceNum) заменяются, остальные выжили. prepare вызывается один раз на клан за шаг,
+//sample - на каждого кандидата, в parents отдает слоты родителей для журнала поколений.
+//Состояние хранится по кланам: задачи разных кланов идут в пуле параллельно и меняют только
+//состояние своего клана.
+//population.optimizer type: ga - скрещивание Strat::born и отбор population.selection,
+//de - дифференциальная эволюция, cmaes - CMA-ES.
+class StratOptimizer
+{
+public:
+	using Parents = std::pair<size_t, size_t>;//слоты родителей в strats
+	static constexpr size_t NO_PARENT = static_cast<size_t>(-1);
+	static std::unique_ptr<StratOptimizer> make(const std::string& path);
+	virtual ~StratOptimizer(){};
+	virtual void init(size_t){};
+	//может переставлять выживших members[replaceNum, size)
+	virtual void prepare(const StratMatrix&, std::vector<size_t>&, size_t, size_t){};
+	virtual void sample(const StratMatrix& strats, const std::vector<size_t>& members, size_t replaceNum,
+			size_t clanNum, double* genes, Parents& parents)const = 0;
+};
+
+#endif /* STRATOPTIMIZER_H_ */
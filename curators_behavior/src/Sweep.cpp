@@ -0,0 +1,329 @@
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <fstream>
+#include <numeric>
+#include <set>
+#include <sstream>
+#include "Sweep.h"
+
+SweepDesign::Type SweepDesign::typeFromStr(const std::string& str)
+{
+	if(str == "grid")
+		return Type::GRID;
+	else if(str == "lhs")
+		return Type::LHS;
+	else if(str == "sobol")
+		return Type::SOBOL;
+	throw std::runtime_error(std::string("SweepDesign::typeFromStr: unknown design <") + str + ">");
+}
+
+std::vector<std::vector<double> > SweepDesign::grid(const std::vector<size_t>& steps)
+{
+	std::vector<std::vector<double> > ret;
+	size_t total = 1;
+	for(auto s : steps)
+		total *= std::max(s, static_cast<size_t>(1));
+	ret.reserve(total);
+	for(size_t n = 0; n < total; n++)
+	{
+		std::vector<double> point(steps.size());
+		size_t rest = n;
+		for(size_t d = 0; d < steps.size(); d++)
+		{
+			size_t s = std::max(steps[d], static_cast<size_t>(1));
+			size_t k = rest % s;
+			rest /= s;
+			point[d] = (s > 1) ? static_cast<double>(k) / static_cast<double>(s - 1) : 0.5;
+		}
+		ret.emplace_back(std::move(point));
+	}
+	return ret;
+}
+
+std::vector<std::vector<double> > SweepDesign::latinHypercube(size_t dims, size_t samples, std::mt19937& engine)
+{
+	std::vector<std::vector<double> > ret(samples, std::vector<double>(dims));
+	std::uniform_real_distribution<double> dist(0.0, 1.0);
+	std::vector<size_t> strata(samples);
+	for(size_t d = 0; d < dims; d++)
+	{
+		std::iota(strata.begin(), strata.end(), 0);
+		std::shuffle(strata.begin(), strata.end(), engine);
+		for(size_t i = 0; i < samples; i++)
+			ret[i][d] = (static_cast<double>(strata[i]) + dist(engine)) / static_cast<double>(samples);
+	}
+	return ret;
+}
+
+std::vector<std::vector<double> > SweepDesign::sobol(size_t dims, size_t samples)
+{
+	//направляющие числа Joe & Kuo (new-joe-kuo-6.21201) для измерений 2..12,
+	//первое измерение - последовательность ван дер Корпута
+	struct Direction{unsigned s; unsigned a; std::array<uint32_t, 5> m;};
+	static const std::array<Direction, 11> directions =
+	{{
+		{1, 0,  {1}},
+		{2, 1,  {1, 3}},
+		{3, 1,  {1, 3, 1}},
+		{3, 2,  {1, 1, 1}},
+		{4, 1,  {1, 1, 3, 3}},
+		{4, 4,  {1, 3, 5, 13}},
+		{5, 2,  {1, 1, 5, 5, 17}},
+		{5, 4,  {1, 1, 5, 5, 5}},
+		{5, 7,  {1, 1, 7, 11, 19}},
+		{5, 11, {1, 1, 5, 1, 1}},
+		{5, 13, {1, 1, 1, 3, 11}}
+	}};
+	static constexpr unsigned BITS = 32;
+	if(dims > directions.size() + 1)
+		throw std::runtime_error("SweepDesign::sobol: too many dimensions");
+
+	std::vector<std::array<uint32_t, BITS + 1> > v(dims);
+	for(size_t d = 0; d < dims; d++)
+	{
+		auto& cur = v[d];
+		if(!d)
+		{
+			for(unsigned i = 1; i <= BITS; i++)
+				cur[i] = 1u << (BITS - i);
+			continue;
+		}
+		const auto& dir = directions[d - 1];
+		for(unsigned i = 1; (i <= dir.s) && (i <= BITS); i++)
+			cur[i] = dir.m[i - 1] << (BITS - i);
+		for(unsigned i = dir.s + 1; i <= BITS; i++)
+		{
+			cur[i] = cur[i - dir.s] ^ (cur[i - dir.s] >> dir.s);
+			for(unsigned k = 1; k < dir.s; k++)
+				cur[i] ^= ((dir.a >> (dir.s - 1 - k)) & 1u) * cur[i - k];
+		}
+	}
+
+	std::vector<std::vector<double> > ret(samples, std::vector<double>(dims));
+	std::vector<uint32_t> x(dims, 0);
+	//нулевая точка пропускается
+	for(size_t n = 1; n <= samples; n++)
+	{
+		unsigned c = 1;
+		size_t value = n - 1;
+		while(value & 1)
+		{
+			value >>= 1;
+			c++;
+		}
+		for(size_t d = 0; d < dims; d++)
+		{
+			x[d] ^= v[d][c];
+			ret[n - 1][d] = static_cast<double>(x[d]) / std::pow(2.0, BITS);
+		}
+	}
+	return ret;
+}
+
+std::vector<std::vector<double> > SweepDesign::make(Type type, const std::vector<size_t>& steps, size_t samples, unsigned seed)
+{
+	std::mt19937 engine(seed);
+	switch(type)
+	{
+	case Type::GRID:
+		return grid(steps);
+	case Type::LHS:
+		return latinHypercube(steps.size(), samples, engine);
+	case Type::SOBOL:
+		return sobol(steps.size(), samples);
+	}
+	throw std::logic_error("SweepDesign::make: unknown design type");
+}
+
+double Sweep::Param::scale(double u)const
+{
+	if(!integer)
+		return min + (u * (max - min));
+	//каждому из n значений - равная доля [0, 1]: при округлении u * (n - 1) крайним доставалась половина
+	double first = std::round(min);
+	double n = std::max(std::round(max) - first + 1.0, 1.0);
+	return first + std::min(std::floor(u * n), n - 1.0);
+}
+
+std::string Sweep::Param::format(double u)const
+{
+	if(!values.empty())
+		return values[static_cast<size_t>(scale(u))];
+	std::ostringstream value;
+	value.precision(12);
+	value << scale(u);
+	return value.str();
+}
+
+Sweep::Sweep(const std::string& fileName)
+{
+	pugi::xml_document doc;
+	if (!doc.load_file(fileName.c_str()))
+		throw std::runtime_error(std::string("Sweep: can't load file: ") + fileName);
+	pugi::xml_node root = doc.first_child();
+	_type = SweepDesign::typeFromStr(Xml::getAttribute(root, "design").as_string());
+	_samples = root.attribute("samples").as_uint(1);
+	_seed = root.attribute("seed").as_uint(0);
+
+	Xml::NodesList paramNodes(root, "_");
+	while(!paramNodes.finished())
+	{
+		const auto& node = paramNodes.get();
+		if(node.attribute("values"))
+		{
+			//values="ga,de,cmaes": по шагу сетки на значение
+			Param param{Xml::getAttribute(node, "param").as_string(), 0.0, 0.0, 0, true, {}};
+			std::istringstream values(node.attribute("values").as_string());
+			std::string value;
+			while(std::getline(values, value, ','))
+				if(!value.empty())
+					param.values.push_back(value);
+			if(param.values.empty())
+				throw std::runtime_error(std::string("Sweep: empty values of ") + param.name);
+			param.max = static_cast<double>(param.values.size() - 1);
+			param.steps = param.values.size();
+			_params.push_back(param);
+		}
+		else
+			_params.push_back({
+					Xml::getAttribute(node, "param").as_string(),
+					Xml::getAttribute(node, "min").as_double(),
+					Xml::getAttribute(node, "max").as_double(),
+					node.attribute("steps").as_uint(3),
+					node.attribute("integer").as_bool(false),
+					{}});
+		paramNodes.next();
+	}
+	if(_params.empty())
+		throw std::runtime_error(std::string("Sweep: no parameters in ") + fileName);
+}
+
+std::vector<std::vector<std::string> > Sweep::makeAssignments() const
+{
+	std::vector<std::vector<std::string> > ret;
+	if(_params.empty())
+	{
+		ret.emplace_back();
+		return ret;
+	}
+	std::vector<size_t> steps;
+	for(const auto& p : _params)
+		steps.push_back(p.steps);
+	for(const auto& point : SweepDesign::make(_type, steps, _samples, _seed))
+	{
+		std::vector<std::string> assignments;
+		for(size_t d = 0; d < _params.size(); d++)
+			assignments.emplace_back(_params[d].name + "=" + _params[d].format(point[d]));
+		ret.emplace_back(std::move(assignments));
+	}
+	return ret;
+}
+
+std::vector<Sweep::Job> Sweep::makeJobs(const std::shared_ptr<const Settings>& base,
+		const std::string& inputFolder, const std::string& outputFolder) const
+{
+	std::vector<Job> ret;
+	{
+		//опечатка в имени параметра иначе всплывет только в первом задании
+		Settings::Scope settingsScope(base);
+		for(const auto& param : _params)
+		{
+			size_t dot = param.name.rfind('.');
+			bool added = !param.name.empty() && (param.name[0] == '+');
+			if(!added && ((dot == std::string::npos) ||
+					!Settings::exist(param.name.substr(0, dot), param.name.substr(dot + 1))))
+				throw std::runtime_error(std::string("Sweep: unknown setting: ") + param.name);
+		}
+	}
+	auto points = makeAssignments();
+	for(size_t p = 0; p < points.size(); p++)
+	{
+		auto settings = empty() ? base : base->derive(points[p]);
+		Settings::Scope settingsScope(settings);
+		unsigned seed = Settings::exist("main", "seed") ? Settings::attribute("main", "seed").as_uint() : 0;
+		double cost = Settings::get("environment", "passesNum") *
+				Settings::get("environment", "articlesNum");
+		bool binaryReport = Settings::exist("report", "format") &&
+				(std::string(Settings::attribute("report", "format").as_string()) == "binary");
+		std::string ext(binaryReport ? ".pop" : ".xml");
+		size_t i = 0;
+		std::string rulePath(std::string("rules._") + std::to_string(i));
+		while((i < Settings::attribute("main", "rulesLimit").as_uint()) && Settings::exist(rulePath))
+		{
+			for(size_t j = 0; j < Settings::attribute("main", "copies").as_uint(); j++)
+			{
+				std::string numStr = std::to_string(i) + "_" + std::to_string(j);
+				Job job;
+				job.point = p;
+				job.rule = i;
+				job.copy = j;
+				job.seed = seed ? (seed + j) : 0;
+				job.rulePath = rulePath;
+				job.assignments = points[p];
+				job.settings = settings;
+				if(!inputFolder.empty())
+				{
+					//сохраненное окружение может быть в бинарном архиве или в xml
+					job.inputFileName = inputFolder + "/_" + numStr + ".pop";
+					if(!std::ifstream(job.inputFileName))
+						job.inputFileName = inputFolder + "/_" + numStr + ".xml";
+				}
+				job.resultFileName = outputFolder + "/_" +
+						(empty() ? std::string() : ("p" + std::to_string(p) + "_")) + numStr + ext;
+				job.cost = cost;
+				job.status = "pending";
+				job.seconds = 0.0;
+				ret.emplace_back(std::move(job));
+			}
+			rulePath = std::string("rules._") + std::to_string(++i);
+		}
+	}
+	return ret;
+}
+
+void Sweep::orderByCost(std::vector<Job*>& jobs)
+{
+	std::stable_sort(jobs.begin(), jobs.end(), [](const Job* lhs, const Job* rhs){return lhs->cost > rhs->cost;});
+}
+
+void Sweep::writeResults(const std::string& fileName, const std::vector<Job>& jobs) const
+{
+	std::set<std::string> metricNames;
+	for(const auto& job : jobs)
+		for(const auto& m : job.metrics)
+			metricNames.insert(m.first);
+
+	std::string tmpFileName = fileName + ".tmp";
+	{
+		std::ofstream file(tmpFileName);
+		if(!file)
+			throw std::runtime_error(std::string("Sweep::writeResults: can't open file: ") + tmpFileName);
+		file << "point\trule\tcopy";
+		for(const auto& p : _params)
+			file << "\t" << p.name;
+		file << "\tsettingsHash\tstatus\tseconds";
+		for(const auto& name : metricNames)
+			file << "\t" << name;
+		file << "\n";
+
+		file.precision(12);
+		for(const auto& job : jobs)
+		{
+			file << job.point << "\t" << job.rule << "\t" << job.copy;
+			for(const auto& a : job.assignments)
+				file << "\t" << a.substr(a.find('=') + 1);
+			file << "\t" << job.settings->hash() << "\t" << job.status << "\t" << job.seconds;
+			for(const auto& name : metricNames)
+			{
+				auto i = job.metrics.find(name);
+				file << "\t";
+				if(i != job.metrics.end())
+					file << i->second;
+			}
+			file << "\n";
+		}
+	}
+	if(std::rename(tmpFileName.c_str(), fileName.c_str()))
+		throw std::runtime_error(std::string("Sweep::writeResults: can't rename to ") + fileName);
+}
@@ -0,0 +1,71 @@
+#ifndef SWEEP_H_
+#define SWEEP_H_
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "Utils.h"
+
+class SweepDesign
+{
+	static std::vector<std::vector<double> > grid(const std::vector<size_t>& steps);
+	static std::vector<std::vector<double> > latinHypercube(size_t dims, size_t samples, std::mt19937& engine);
+	static std::vector<std::vector<double> > sobol(size_t dims, size_t samples);
+public:
+	enum class Type{GRID, LHS, SOBOL};
+	static Type typeFromStr(const std::string& str);
+	//точки плана в единичном кубе [0, 1]^dims
+	static std::vector<std::vector<double> > make(Type type, const std::vector<size_t>& steps, size_t samples, unsigned seed);
+};
+
+class Sweep
+{
+public:
+	struct Param
+	{
+		std::string name;//path.attr, как в --set (+path.attr - новый атрибут)
+		double min;
+		double max;
+		size_t steps;
+		bool integer;
+		std::vector<std::string> values;//непустой - перечислимый параметр, точка выбирает значение
+		double scale(double u)const;
+		std::string format(double u)const;
+	};
+
+	struct Job
+	{
+		size_t point;
+		size_t rule;
+		size_t copy;
+		unsigned seed;//0 - случайный
+		std::string rulePath;
+		std::vector<std::string> assignments;
+		std::shared_ptr<const Settings> settings;
+		std::string inputFileName;
+		std::string resultFileName;
+		double cost;//оценка трудоемкости, задания запускаются по убыванию
+
+		std::string status;
+		double seconds;
+		std::map<std::string, double> metrics;
+	};
+
+private:
+	std::vector<Param> _params;
+	SweepDesign::Type _type;
+	size_t _samples;
+	unsigned _seed;
+	std::vector<std::vector<std::string> > makeAssignments() const;
+
+public:
+	Sweep() : _type(SweepDesign::Type::GRID), _samples(1), _seed(0){};
+	explicit Sweep(const std::string& fileName);
+	bool empty()const {return _params.empty();};
+	std::vector<Job> makeJobs(const std::shared_ptr<const Settings>& base,
+			const std::string& inputFolder, const std::string& outputFolder) const;
+	static void orderByCost(std::vector<Job*>& jobs);
+	void writeResults(const std::string& fileName, const std::vector<Job>& jobs) const;
+};
+
+#endif /* SWEEP_H_ */
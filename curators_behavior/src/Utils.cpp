@@ -1,4 +1,8 @@
 
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <mutex>
 #include "Utils.h"
 
 const pugi::xml_node& Xml::NodesList::get()const
@@ -25,16 +29,250 @@ double Rnd::uniform(double a, double b)
 	return dist(engine());
 }
 
+Rnd& Rnd::instance()
+{
+	//у каждого потока пула свой генератор
+	thread_local Rnd instance;
+	return instance;
+}
+
 std::mt19937& Rnd::engine()
 {
-	static Rnd instance;
-	return instance._engine;
+	return *instance()._current;
+}
+
+void Rnd::seed(unsigned val)
+{
+	Rnd& rnd = instance();
+	rnd._engine.seed(val ? val : rnd._device());
+}
+
+uint64_t Rnd::hash(uint64_t val)
+{
+	val += 0x9e3779b97f4a7c15ull;
+	val = (val ^ (val >> 30)) * 0xbf58476d1ce4e5b9ull;
+	val = (val ^ (val >> 27)) * 0x94d049bb133111ebull;
+	return val ^ (val >> 31);
+}
+
+Permutation::Permutation(size_t size, uint64_t key) : _key(key), _size(size), _halfBits(1)
+{
+	while((_halfBits < 32) && ((static_cast<uint64_t>(1) << (2 * _halfBits)) < size))
+		_halfBits++;
+	_halfMask = (static_cast<uint64_t>(1) << _halfBits) - 1;
+}
+
+size_t Permutation::operator()(size_t index)const
+{
+	if(index >= _size)
+		throw std::runtime_error("Permutation::operator(): index out of range");
+	uint64_t val = index;
+	do
+	{
+		uint64_t left = val >> _halfBits;
+		uint64_t right = val & _halfMask;
+		for(unsigned round = 0; round < ROUNDS; round++)
+		{
+			uint64_t next = left ^ (Rnd::hash(_key ^ (static_cast<uint64_t>(round) << 56) ^ right) & _halfMask);
+			left = right;
+			right = next;
+		}
+		val = (left << _halfBits) | right;
+	}
+	while(val >= _size);
+	return static_cast<size_t>(val);
+}
+
+Rnd::StreamScope::StreamScope(std::mt19937* stream) : _saved(instance()._current)
+{
+	if(stream)
+		instance()._current = stream;
+}
+
+Rnd::StreamScope::~StreamScope()
+{
+	instance()._current = _saved;
+}
+
+std::string hashStr(const std::string& data)
+{
+	uint64_t h = 14695981039346656037ULL;
+	for(unsigned char c : data)
+	{
+		h ^= c;
+		h *= 1099511628211ULL;
+	}
+	std::ostringstream hex;
+	hex << std::hex << std::setw(16) << std::setfill('0') << h;
+	return hex.str();
+}
+
+thread_local std::shared_ptr<const Settings> Settings::s_current;
+
+std::shared_ptr<const Settings>& Settings::defaultInstance()
+{
+	static std::shared_ptr<const Settings> instance;
+	return instance;
+}
+
+void Settings::setDefault(const std::shared_ptr<const Settings>& settings)
+{
+	defaultInstance() = settings;
+}
+
+std::shared_ptr<const Settings> Settings::current()
+{
+	if(s_current)
+		return s_current;
+	static std::once_flag loaded;
+	std::call_once(loaded, [](){
+		if(!defaultInstance())
+			defaultInstance() = load("Settings.xml");
+	});
+	return defaultInstance();
+}
+
+Settings::Scope::Scope(const std::shared_ptr<const Settings>& settings) : _prev(s_current)
+{
+	s_current = settings;
+}
+
+Settings::Scope::~Scope()
+{
+	s_current = _prev;
+}
+
+std::shared_ptr<const Settings> Settings::load(const std::string& fileName,
+		const std::vector<std::string>& overrideFiles,
+		const std::vector<std::string>& assignments)
+{
+	std::shared_ptr<Settings> ret(new Settings());
+	if (!ret->_doc.load_file(fileName.c_str()))
+		throw std::runtime_error(std::string("Settings: can't load file: ") + fileName);
+	for(const auto& overrideFile : overrideFiles)
+	{
+		pugi::xml_document overrideDoc;
+		if (!overrideDoc.load_file(overrideFile.c_str()))
+			throw std::runtime_error(std::string("Settings: can't load override file: ") + overrideFile);
+		if(std::string(overrideDoc.first_child().name()) != ret->_doc.first_child().name())
+			throw std::runtime_error(std::string("Settings: root node mismatch in override file: ") + overrideFile);
+		ret->merge(overrideDoc.first_child(), ret->_doc.first_child(), std::string(), false);
+	}
+	for(const auto& a : assignments)
+		ret->assign(a);
+	ret->updateHash();
+	return ret;
+}
+
+std::shared_ptr<const Settings> Settings::derive(const std::vector<std::string>& assignments) const
+{
+	std::shared_ptr<Settings> ret(new Settings());
+	ret->_doc.reset(_doc);
+	for(const auto& a : assignments)
+		ret->assign(a);
+	ret->updateHash();
+	return ret;
+}
+
+void Settings::merge(const pugi::xml_node& src, pugi::xml_node dst, const std::string& path, bool allowNew)
+{
+	allowNew = allowNew || src.attribute("_new").as_bool();
+	for(const auto& attr : src.attributes())
+	{
+		if(std::string(attr.name()) == "_new")
+			continue;
+		auto dstAttr = dst.attribute(attr.name());
+		if(dstAttr.empty() && !allowNew)
+			throw std::runtime_error(std::string("Settings::merge: unknown setting: ") + path + "." + attr.name());
+		if(dstAttr.empty())
+			dstAttr = dst.append_attribute(attr.name());
+		dstAttr.set_value(attr.value());
+	}
+	for(const auto& child : src.children())
+	{
+		if(child.type() != pugi::node_element)
+			continue;
+		std::string childPath = path.empty() ? std::string(child.name()) : (path + "." + child.name());
+		auto dstChild = dst.child(child.name());
+		if(dstChild.empty() && !allowNew && !child.attribute("_new").as_bool())
+			throw std::runtime_error(std::string("Settings::merge: unknown setting: ") + childPath);
+		if(dstChild.empty())
+			dstChild = dst.append_child(child.name());
+		merge(child, dstChild, childPath, allowNew);
+	}
+}
+
+void Settings::assign(const std::string& assignment)
+{
+	bool allowNew = !assignment.empty() && (assignment[0] == '+');
+	size_t begin = allowNew ? 1 : 0;
+	size_t eq = assignment.find('=');
+	if((eq == std::string::npos) || (eq == begin))
+		throw std::runtime_error(std::string("Settings::assign: expected path.attr=value, got: ") + assignment);
+	std::string fullName = assignment.substr(begin, eq - begin);
+	size_t dot = fullName.rfind('.');
+	std::string path = (dot == std::string::npos) ? std::string() : fullName.substr(0, dot);
+	std::string name = (dot == std::string::npos) ? fullName : fullName.substr(dot + 1);
+	if(name.empty())
+		throw std::runtime_error(std::string("Settings::assign: empty attribute name: ") + assignment);
+
+	pugi::xml_node node = _doc.first_child();
+	std::string childName;
+	for(auto i = path.begin(); ; i++)
+	{
+		if((i == path.end()) || (*i == '.'))
+		{
+			if(!childName.empty())
+			{
+				auto child = node.child(childName.c_str());
+				if(child.empty() && !allowNew)
+					throw std::runtime_error(std::string("Settings::assign: unknown setting: ") + fullName +
+							" (\"+" + fullName + "=...\" adds a new one)");
+				node = child.empty() ? node.append_child(childName.c_str()) : child;
+			}
+			childName.clear();
+			if(i == path.end())
+				break;
+		}
+		else
+			childName += *i;
+	}
+	auto attr = node.attribute(name.c_str());
+	if(attr.empty() && !allowNew)
+		throw std::runtime_error(std::string("Settings::assign: unknown setting: ") + fullName +
+				" (\"+" + fullName + "=...\" adds a new one)");
+	if(attr.empty())
+		attr = node.append_attribute(name.c_str());
+	attr.set_value(assignment.substr(eq + 1).c_str());
+}
+
+void Settings::updateHash()
+{
+	//хэш канонической (без форматирования) записи документа
+	std::ostringstream stream;
+	_doc.save(stream, "", pugi::format_raw | pugi::format_no_declaration);
+	_hash = hashStr(stream.str());
+}
+
+std::string Settings::hash(const std::vector<std::string>& excludedNodes)const
+{
+	pugi::xml_document doc;
+	doc.reset(_doc);
+	for(const auto& name : excludedNodes)
+		doc.first_child().remove_child(name.c_str());
+	std::ostringstream stream;
+	doc.save(stream, "", pugi::format_raw | pugi::format_no_declaration);
+	return hashStr(stream.str());
 }
 
-Settings::Settings()
+void Settings::save(const std::string& fileName)const
 {
-	if (!_doc.load_file("Settings.xml"))
-		throw std::runtime_error("Settings: can't load file");
+	std::ofstream file(fileName);
+	if(!file)
+		throw std::runtime_error(std::string("Settings::save: can't open file: ") + fileName);
+	file << "<?xml version=\"1.0\"?>\n";
+	file << "<!-- hash: " << _hash << " -->\n";
+	_doc.save(file, " ", pugi::format_indent | pugi::format_no_declaration);
 }
 
 pugi::xml_node Xml::getNode(const pugi::xml_node& node, const std::string& relativePath, bool strict)
@@ -60,8 +298,7 @@ pugi::xml_node Xml::getNode(const pugi::xml_node& node, const std::string& relat
 
 pugi::xml_node Settings::getNode(const std::string& path, bool strict)
 {
-	static Settings instance;
-	pugi::xml_node parent = instance._doc.first_child();
+	pugi::xml_node parent = (s_current ? *s_current : *current())._doc.first_child();
 	return Xml::getNode(parent, path, strict);
 }
 
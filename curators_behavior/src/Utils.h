@@ -1,13 +1,21 @@
 #ifndef UTILS_H_
 #define UTILS_H_
+#include <chrono>
+#include <cstdint>
 #include <random>
 #include <tuple>
 #include <nlopt.hpp>
 #include <iostream>
 #include <algorithm>
+#include <memory>
+#include <vector>
+#include <string>
 #include <boost/math/distributions.hpp>
 #include "pugixml/pugixml.hpp"
 
+//FNV-1a, 64 бита, в виде hex-строки
+std::string hashStr(const std::string& data);
+
 namespace Xml
 {
 	pugi::xml_node getNode(const pugi::xml_node& node, const std::string& relativePath, bool strict = true);
@@ -31,7 +39,27 @@ namespace Xml
 class Settings
 {
 	pugi::xml_document _doc;
+	std::string _hash;
+	static thread_local std::shared_ptr<const Settings> s_current;
+	static std::shared_ptr<const Settings>& defaultInstance();
+	//узлы и атрибуты, которых нет в основном файле, - ошибка (скорее всего опечатка), если они не
+	//объявлены новыми: в файле переопределений атрибутом _new="1" узла, в присваивании префиксом "+"
+	void merge(const pugi::xml_node& src, pugi::xml_node dst, const std::string& path, bool allowNew);
+	void assign(const std::string& assignment);
+	void updateHash();
 public:
+	//привязывает конфигурацию к текущему потоку на время жизни объекта,
+	//так в одном процессе могут работать окружения с разными параметрами
+	class Scope
+	{
+		std::shared_ptr<const Settings> _prev;
+	public:
+		explicit Scope(const std::shared_ptr<const Settings>& settings);
+		~Scope();
+		Scope(Scope const&) = delete;
+		void operator=(Scope const&) = delete;
+	};
+
 	static pugi::xml_node getNode(const std::string& path, bool strict = true);
 	//static pugi::xml_attribute getAttribute(const pugi::xml_node& node, const std::string& name);
 
@@ -43,23 +71,65 @@ public:
 	static double getRnd(const std::string& path);
 	static double getRnd(const pugi::xml_node& node);
 	//возвращает одномерную случайную величину, имеющую распределение, описанное в соответствующем узле
+
+	//основной файл, поверх него по порядку файлы переопределений, затем присваивания вида "path.attr=value"
+	//("+path.attr=value" - новый атрибут или узел)
+	static std::shared_ptr<const Settings> load(const std::string& fileName,
+			const std::vector<std::string>& overrideFiles = {},
+			const std::vector<std::string>& assignments = {});
+	std::shared_ptr<const Settings> derive(const std::vector<std::string>& assignments) const;
+	static void setDefault(const std::shared_ptr<const Settings>& settings);
+	static std::shared_ptr<const Settings> current();
+	const std::string& hash()const {return _hash;};//хэш итоговой конфигурации
+	std::string hash(const std::vector<std::string>& excludedNodes)const;//хэш без указанных узлов верхнего уровня
+	void save(const std::string& fileName)const;
 private:
-	Settings();
+	Settings(){};
 };
 
 class Rnd
 {
 	std::random_device _device;
 	std::mt19937 _engine;
+	std::mt19937* _current;
 public:
 	Rnd(Rnd const&) = delete;
 	void operator=(Rnd const&) = delete;
+	static void seed(unsigned val);//0 - из std::random_device
 	static int choose(int a = 0, int b = 1);
 	static double uniform(double a = 0.0, double b = 1.0);
 	static std::mt19937& engine();
+	static uint64_t hash(uint64_t val);//splitmix64: перемешивание ключа в зерно
+
+	//на время жизни переключает Rnd потока на генератор stream (nullptr - не переключает),
+	//основной генератор при этом не сдвигается
+	class StreamScope
+	{
+		std::mt19937* _saved;
+	public:
+		explicit StreamScope(std::mt19937* stream);
+		~StreamScope();
+		StreamScope(StreamScope const&) = delete;
+		void operator=(StreamScope const&) = delete;
+	};
 
 private:
-	Rnd():_engine(_device()){};
+	static Rnd& instance();
+	Rnd():_engine(_device()), _current(&_engine){};
+};
+
+//Псевдослучайная перестановка индексов [0, size) без хранения: сеть Фейстеля на ближайшей сверху
+//четной степени двойки, значения вне диапазона проходят сеть повторно (в среднем меньше 4 раз)
+class Permutation
+{
+	static constexpr unsigned ROUNDS = 4;
+	uint64_t _key;
+	size_t _size;
+	unsigned _halfBits;
+	uint64_t _halfMask;
+public:
+	Permutation(size_t size, uint64_t key);
+	size_t operator()(size_t index)const;
 };
 
 class RndVariable
@@ -132,14 +202,209 @@ public:
 
 double linearInterpolation(const std::pair<double, double>& a, const std::pair<double, double>& b, double x);
 
-//class Arg
+//class Points
 //{
-//	double dist(const Arg& rhs) const;
-//  double getObservation() const;
-//	void setSmoothedVal(double);
-//	double getWeight() const;
+//	size_t size() const;
+//	double dist(size_t lhs, size_t rhs) const;
+//	double getObservation(size_t i) const;
+//	void setSmoothedVal(size_t i, double);
+//	double getWeight(size_t i) const;
+//	uint64_t getRevision(size_t i) const;//меняется при каждом изменении точки i
 //}
-template<class Arg>
+
+//Симметричная матрица попарных расстояний между точками Points, хранится между вызовами update():
+//пересчитываются только строки и столбцы точек, ревизия которых изменилась (новорожденные стратегии),
+//остальные расстояния берутся из прошлого поколения.
+template<class Points>
+class DistCache
+{
+	std::vector<double> _dists;
+	std::vector<uint64_t> _revisions;//ревизии точек, по которым посчитаны строки, 0 - не посчитана
+	std::vector<char> _stale;
+	size_t _size = 0;
+public:
+	//возвращает число пересчитанных строк
+	size_t update(const Points& points)
+	{
+		size_t size = points.size();
+		if(size != _size)
+		{
+			_size = size;
+			_dists.assign(size * size, 0.0);
+			_revisions.assign(size, 0);
+		}
+		_stale.assign(size, 0);
+		size_t staleNum = 0;
+		for(size_t i = 0; i < size; i++)
+			if(_revisions[i] != points.getRevision(i))
+			{
+				_stale[i] = 1;
+				_revisions[i] = points.getRevision(i);
+				staleNum++;
+			}
+		for(size_t i = 0; i < size; i++)
+		{
+			if(!_stale[i])
+				continue;
+			double* row = _dists.data() + (i * size);
+			for(size_t j = 0; j < size; j++)
+			{
+				if(_stale[j] && (j < i))//пара уже посчитана в строке j
+					continue;
+				double d = (i == j) ? 0.0 : points.dist(i, j);
+				row[j] = d;
+				_dists[(j * size) + i] = d;
+			}
+		}
+		return staleNum;
+	}
+	double operator()(size_t lhs, size_t rhs)const {return _dists[(lhs * _size) + rhs];};
+};
+
+//Метрическое дерево шаров над точками Points: центр узла - одна из его точек,
+//радиус - расстояние до самой дальней, поэтому нужна только dist().
+//В узлах хранятся суммы весов и взвешенных наблюдений для сглаживания ядром 1 / (1 + c * d).
+//Обход от ближних узлов к дальним; шар учитывается целиком по середине интервала значений ядра,
+//если его ошибка, отнесенная к доле шара в общем весе, не больше tolerance от уже набранной суммы.
+//Тогда суммарная относительная ошибка суммы весов ядра (и суммы |наблюдений| с весами) не больше tolerance.
+template<class Points>
+class BallTree
+{
+	static constexpr size_t LEAF_SIZE = 16;
+	struct Node
+	{
+		size_t pivot;
+		double radius;
+		double sumW;//сумма весов точек
+		double sumWO;//сумма весов, умноженных на наблюдения
+		size_t first;//точки узла - _order[first, last)
+		size_t last;
+		size_t left;//0 - лист
+		size_t right;
+	};
+	std::vector<Node> _nodes;
+	std::vector<size_t> _order;
+	std::vector<double> _distBuf;
+
+	size_t build(const Points& points, size_t first, size_t last)
+	{
+		size_t nodeNum = _nodes.size();
+		_nodes.emplace_back();
+		Node node = {_order[first], 0.0, 0.0, 0.0, first, last, 0, 0};
+		size_t farthest = node.pivot;
+		for(size_t i = first; i < last; i++)
+		{
+			size_t p = _order[i];
+			double d = points.dist(node.pivot, p);
+			if(d > node.radius)
+			{
+				node.radius = d;
+				farthest = p;
+			}
+			node.sumW += points.getWeight(p);
+			node.sumWO += points.getWeight(p) * points.getObservation(p);
+		}
+		if(((last - first) > LEAF_SIZE) && (node.radius > 0.0))
+		{
+			//делим по двум далеким точкам: farthest от центра и самой далекой от нее
+			size_t a = farthest;
+			size_t b = a;
+			double maxD = 0.0;
+			for(size_t i = first; i < last; i++)
+			{
+				_distBuf[i] = points.dist(a, _order[i]);
+				if(_distBuf[i] > maxD)
+				{
+					maxD = _distBuf[i];
+					b = _order[i];
+				}
+			}
+			size_t middle = first;
+			for(size_t i = first; i < last; i++)
+				if(_distBuf[i] <= points.dist(b, _order[i]))
+				{
+					std::swap(_order[i], _order[middle]);
+					std::swap(_distBuf[i], _distBuf[middle]);
+					++middle;
+				}
+			if((middle > first) && (middle < last))
+			{
+				node.left = build(points, first, middle);
+				node.right = build(points, middle, last);
+			}
+		}
+		_nodes[nodeNum] = node;
+		return nodeNum;
+	}
+
+	void accumulate(const Points& points, size_t nodeNum, double d, size_t point, double c, double tolerance,
+			double& sumWO, double& sumW)const
+	{
+		const Node& node = _nodes[nodeNum];
+		if((d > node.radius) && (sumW > 0.0))//точка вне шара, среди точек узла ее нет
+		{
+			double maxK = 1.0 / (1.0 + (c * (d - node.radius)));
+			double minK = 1.0 / (1.0 + (c * (d + node.radius)));
+			if((0.5 * (maxK - minK) * _nodes.front().sumW) <= (tolerance * sumW))
+			{
+				double k = std::min(0.5 * (maxK + minK), 0.999);
+				sumWO += k * node.sumWO;
+				sumW += k * node.sumW;
+				return;
+			}
+		}
+		if(node.left)
+		{
+			double dLeft = points.dist(point, _nodes[node.left].pivot);
+			double dRight = points.dist(point, _nodes[node.right].pivot);
+			if(dLeft <= dRight)
+			{
+				accumulate(points, node.left, dLeft, point, c, tolerance, sumWO, sumW);
+				accumulate(points, node.right, dRight, point, c, tolerance, sumWO, sumW);
+			}
+			else
+			{
+				accumulate(points, node.right, dRight, point, c, tolerance, sumWO, sumW);
+				accumulate(points, node.left, dLeft, point, c, tolerance, sumWO, sumW);
+			}
+			return;
+		}
+		for(size_t i = node.first; i < node.last; i++)
+		{
+			size_t j = _order[i];
+			double curW = 1.0 / (1.0 + (c * points.dist(point, j)));
+			if(point != j)
+				curW = std::min(curW, 0.999);
+			curW *= points.getWeight(j);
+			sumWO += points.getObservation(j) * curW;
+			sumW += curW;
+		}
+	}
+
+public:
+	bool empty()const {return _nodes.empty();};
+	void clear() {_nodes.clear();};
+	void build(const Points& points)
+	{
+		_nodes.clear();
+		_order.resize(points.size());
+		_distBuf.resize(points.size());
+		for(size_t i = 0; i < _order.size(); i++)
+			_order[i] = i;
+		if(!_order.empty())
+			build(points, 0, _order.size());
+	}
+	//суммы по всем точкам весов ядра с центром в point (sumW) и взвешенных наблюдений (sumWO)
+	void accumulate(const Points& points, size_t point, double c, double tolerance, double& sumWO, double& sumW)const
+	{
+		sumWO = 0.0;
+		sumW = 0.0;
+		if(!_nodes.empty())
+			accumulate(points, 0, points.dist(point, _nodes.front().pivot), point, c, tolerance, sumWO, sumW);
+	}
+};
+
+template<class Points>
 class Squelch
 {
 	//см. "Genetic Algorithms for Optimization of Noisy Fitness
@@ -150,23 +415,61 @@ class Squelch
 	{
 		std::vector<double> distances;
 		std::vector<double> augmentations;// (F(hl) - f(x))^2
-		explicit ParamsObjective(size_t pointsNum): distances(pointsNum), augmentations(pointsNum){};
+		size_t evals;
+		explicit ParamsObjective(size_t pointsNum): distances(pointsNum), augmentations(pointsNum), evals(0){};
 
 		static double get(const std::vector<double> &x, std::vector<double> &grad, void *data)
 		{
 			//x[0] - dispersion, x[1] - distFactor
 			ParamsObjective* d = reinterpret_cast<ParamsObjective*>(data);
+			d->evals++;
 			size_t pointsNum = d->distances.size();
 			double ret = 0.0;
+			double grad0 = 0.0;
+			double grad1 = 0.0;
 			for(size_t i = 0; i < pointsNum; i++)
 			{
-				float a = (d->distances[i] * x[1] + 1.0) * x[0];
+				double a = (d->distances[i] * x[1] + 1.0) * x[0];
 				ret += a + (d->augmentations[i] / a);
+				//d(a + aug / a) = (1 - aug / a^2) da
+				double da = 1.0 - (d->augmentations[i] / (a * a));
+				grad0 += da * (d->distances[i] * x[1] + 1.0);
+				grad1 += da * d->distances[i] * x[0];
+			}
+			if(!grad.empty())
+			{
+				grad[0] = grad0;
+				grad[1] = grad1;
 			}
 			return ret;
 		}
 	};
 public:
+	//остановка подбора параметров, 0 - критерий не используется
+	struct FitOptions
+	{
+		double xtolRel = 0.0;
+		double ftolRel = 0.0;
+		size_t maxEval = 0;
+		bool gradient = false;//LD_LBFGS с аналитическим градиентом вместо LN_SBPLX
+	};
+	//вычисления целевой функции и время подбора параметров
+	struct FitStats
+	{
+		size_t fits = 0;
+		size_t evals = 0;
+		size_t maxEvals = 0;//на один подбор
+		double seconds = 0.0;
+		double maxSeconds = 0.0;//на один подбор
+		void add(const FitStats& rhs)
+		{
+			fits += rhs.fits;
+			evals += rhs.evals;
+			maxEvals = std::max(maxEvals, rhs.maxEvals);
+			seconds += rhs.seconds;
+			maxSeconds = std::max(maxSeconds, rhs.maxSeconds);
+		};
+	};
 	struct Params
 	{
 		double dispersion;
@@ -174,15 +477,22 @@ public:
 		Params(double dispers = 1.0, double distF = 1.0): dispersion(dispers), distFactor(distF){};
 	};
 private:
-	std::vector<std::shared_ptr<const Arg> > _ungrouped;
-	std::vector<std::vector<std::shared_ptr<Arg> > > _tracked;
+	std::vector<std::vector<size_t> > _tracked;//номера отслеживаемых точек, история - все точки
 	std::vector<double> _extDistFactors;
 	std::vector<Params> _params;
+	std::vector<FitStats> _fitStats;//по группам, группы сглаживаются параллельно
+	FitOptions _fitOptions;
 	size_t _centralPointsNum;
+	double _tolerance;//0 - точное сглаживание по всем парам точек
+	BallTree<Points> _tree;
+	DistCache<Points> _dists;//для точного сглаживания
+	double dist(const Points& points, size_t lhs, size_t rhs)const
+		{return (_tolerance > 0.0) ? points.dist(lhs, rhs) : _dists(lhs, rhs);};
 public:
-	Squelch(size_t centralPointsNum = 5) : _centralPointsNum(centralPointsNum){};
+	Squelch(size_t centralPointsNum = 5, double tolerance = 0.0, const FitOptions& fitOptions = FitOptions()) :
+		_fitOptions(fitOptions), _centralPointsNum(centralPointsNum), _tolerance(tolerance){};
 	void init(
-			const std::vector<std::vector<std::shared_ptr<Arg> > >& tracked,
+			const std::vector<std::vector<size_t> >& tracked,
 			const std::vector<double>& extDistFactors = {})
 	{
 		_extDistFactors.resize(tracked.size());
@@ -197,25 +507,55 @@ public:
 		_tracked = tracked;
 		_params.clear();
 		_params.resize(tracked.size());
-		_ungrouped.clear();
-		for(auto& g : _tracked)
-			for(auto& p : g)
-			_ungrouped.emplace_back(p);
+		_fitStats.clear();
+		_fitStats.resize(tracked.size());
 	};
-	void operator()()
+	size_t getGroupsNum()const {return _tracked.size();};
+	//масштаб расстояний ядра группы с последними подобранными параметрами
+	double getDistFactor(size_t groupNum)const {return _extDistFactors[groupNum] * _params[groupNum].distFactor;};
+	FitStats getFitStats()const
 	{
+		FitStats ret;
+		for(const auto& stats : _fitStats)
+			ret.add(stats);
+		return ret;
+	};
+	void operator()(Points& points)
+	{
+		index(points);
 		for(size_t groupNum = 0; groupNum < _tracked.size(); groupNum++)
-		{
-			_params[groupNum] = getParams(_tracked[groupNum], _ungrouped, _params[groupNum], _centralPointsNum);
-			updateSmoothedVals(groupNum);
-		}
+			(*this)(points, groupNum);
+	}
+	//перед сглаживанием групп по отдельности: строит дерево по текущим точкам и наблюдениям
+	//или обновляет матрицу расстояний для изменившихся точек
+	void index(const Points& points)
+	{
+		if(_tolerance > 0.0)
+			_tree.build(points);
+		else
+			_dists.update(points);
+	}
+	//группы независимы: после index() разные группы можно сглаживать параллельно, если points не меняются
+	void operator()(Points& points, size_t groupNum)
+	{
+		auto startTime = std::chrono::steady_clock::now();
+		size_t evals = 0;
+		_params[groupNum] = getParams(points, _tracked[groupNum], _params[groupNum], _centralPointsNum, &evals);
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - startTime;
+		FitStats cur;
+		cur.fits = 1;
+		cur.evals = cur.maxEvals = evals;
+		cur.seconds = cur.maxSeconds = elapsed.count();
+		_fitStats[groupNum].add(cur);
+		updateSmoothedVals(points, groupNum);
 	}
 
-	static Params getParams(
-			const std::vector<std::shared_ptr<Arg> >& points,
-			const std::vector<std::shared_ptr<const Arg> >& history,
+	Params getParams(
+			const Points& history,
+			const std::vector<size_t>& points,
 			const Params& prev,
-			size_t centralPointsNum)
+			size_t centralPointsNum,
+			size_t* evals = nullptr)const
 	{
 		size_t pointsNum = points.size();
 		size_t historySize = history.size();
@@ -226,25 +566,17 @@ public:
 		ParamsObjective objectiveData(historySize);
 
 		//ищем x
-		auto iMaxU = std::max_element(points.begin(), points.end(),
-				 [](const std::shared_ptr<Arg>& lhs,
-					const std::shared_ptr<Arg>& rhs){return lhs->getObservation() < rhs->getObservation();});
+		size_t iMaxU = *std::max_element(points.begin(), points.end(),
+				 [&history](size_t lhs, size_t rhs){return history.getObservation(lhs) < history.getObservation(rhs);});
 		//ищем dl
 		for(size_t i = 0; i < historySize; i++)
-			objectiveData.distances[i] = (*iMaxU)->dist(*(history[i]));
-
-		//for(size_t i = 0; i < historySize; i++)
-		//	std::cout << "dist = " << objectiveData.distances[i] << "\n";
+			objectiveData.distances[i] = dist(history, iMaxU, i);
 
 		//и f(x)
 		//тут дистанции только среди points, ищем ближайшие к x
 		std::vector<std::pair<double, double> > distsAndSamples(pointsNum);
 		for(size_t i = 0; i < pointsNum; i++)
-			distsAndSamples[i] = std::make_pair((*iMaxU)->dist(*(points[i])), points[i]->getObservation());
-
-		//for(size_t i = 0; i < pointsNum; i++)
-		//	std::cout << "dist = " << distsAndSamples[i].first <<
-		//		"; sample = " << distsAndSamples[i].second << "\n";
+			distsAndSamples[i] = std::make_pair(dist(history, iMaxU, points[i]), history.getObservation(points[i]));
 
 		std::partial_sort (distsAndSamples.begin(), distsAndSamples.begin() + centralPointsNum,
 				distsAndSamples.end(), [](
@@ -255,63 +587,73 @@ public:
 			fx += distsAndSamples[i].second;
 		fx /= static_cast<double>(centralPointsNum);
 
-		//std::cout << "fx = " << fx << "\n";
 		//и (F(hl) - f(x))^2
 		for(size_t i = 0; i < historySize; i++)
-			objectiveData.augmentations[i] = std::pow(history[i]->getObservation() - fx, 2.0);
-
-		//for(size_t i = 0; i < historySize; i++)
-		//	std::cout << "augm = " << objectiveData.augmentations[i] << "\n";
+			objectiveData.augmentations[i] = std::pow(history.getObservation(i) - fx, 2.0);
 
-		std::vector<double> x = {prev.dispersion, prev.distFactor};
+		//начинаем с параметров прошлого поколения
+		std::vector<double> x = {std::max(prev.dispersion, 1.e-20), std::max(prev.distFactor, 1.e-20)};
 
-		nlopt::opt opt(nlopt::LN_SBPLX, 2);
+		nlopt::opt opt(_fitOptions.gradient ? nlopt::LD_LBFGS : nlopt::LN_SBPLX, 2);
 		opt.set_lower_bounds(1.e-20);
 		opt.set_min_objective(ParamsObjective::get, &objectiveData);
+		if(_fitOptions.xtolRel > 0.0)
+			opt.set_xtol_rel(_fitOptions.xtolRel);
+		if(_fitOptions.ftolRel > 0.0)
+			opt.set_ftol_rel(_fitOptions.ftolRel);
+		if(_fitOptions.maxEval)
+			opt.set_maxeval(static_cast<int>(_fitOptions.maxEval));
 
 		double minf;
-		nlopt::result result = opt.optimize(x, minf);
-		if(result < nlopt::SUCCESS)
-			throw std::runtime_error("Squelch::getParams: result < nlopt::SUCCESS");
+		try
+		{
+			nlopt::result result = opt.optimize(x, minf);
+			if(result < nlopt::SUCCESS)
+				throw std::runtime_error("Squelch::getParams: result < nlopt::SUCCESS");
+		}
+		catch(const nlopt::roundoff_limited&)
+		{
+			//точнее не получится, x - лучшая найденная точка
+		}
+		if(evals)
+			*evals = objectiveData.evals;
 		//std::cout << "found minimum at f(" << x[0] << "," << x[1] << ") = " << minf << std::endl;
 		return Params(x[0], x[1]);
 	}
 
-	void updateSmoothedVals(size_t groupNum)
+	void updateSmoothedVals(Points& history, size_t groupNum)const
 	{
 		const auto& points = _tracked[groupNum];
 		const auto& params = _params[groupNum];
 		double extDistFactor = _extDistFactors[groupNum];
 
 		size_t pointsNum = points.size();
-		size_t historySize = _ungrouped.size();
-
-		double avgW = 0.0;
+		size_t historySize = history.size();
 
 		for(size_t i = 0; i < pointsNum; i++)
 		{
 			double newVal = 0.0;
 			double sumW = 0.0;
-			for(size_t j = 0; j < historySize; j++)
-			{
-				double curW =  1.0 /
-						(1.0 + ((extDistFactor * params.distFactor) * points[i]->dist(*(_ungrouped[j]))));
-				if(points[i] != _ungrouped[j])
-					curW = std::min(curW, 0.999);
-				avgW += curW;
-				curW *= _ungrouped[j]->getWeight();
-				newVal += _ungrouped[j]->getObservation() * curW;
-				//std::cout << curW << " | ";
-				sumW += curW;
-
-			}
+			if(_tolerance > 0.0)
+				_tree.accumulate(history, points[i], extDistFactor * params.distFactor, _tolerance, newVal, sumW);
+			else
+				for(size_t j = 0; j < historySize; j++)
+				{
+					double curW =  1.0 /
+							(1.0 + ((extDistFactor * params.distFactor) * dist(history, points[i], j)));
+					if(points[i] != j)
+						curW = std::min(curW, 0.999);
+					curW *= history.getWeight(j);
+					newVal += history.getObservation(j) * curW;
+					sumW += curW;
+
+				}
 			if(sumW < 1.e-20)
 				throw std::logic_error("Squelch::updateHistoryVals: sumW < 1.e-20");
 
 			newVal /= sumW;
-			points[i]->setSmoothedVal(newVal);
+			history.setSmoothedVal(points[i], newVal);
 		}
-		//std::cout << "; avgW = " << avgW / static_cast<double>(pointsNum * historySize) << "\n";
 	}
 };
 #endif /* UTILS_H_ */
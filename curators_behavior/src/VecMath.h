@@ -0,0 +1,129 @@
+#ifndef VECMATH_H_
+#define VECMATH_H_
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+//Экспонента без ветвлений и вызовов libm, чтобы циклы по массивам стратегий
+//векторизовались компилятором (-O3 -fno-trapping-math: без последнего gcc
+//не превращает обрезку аргумента в blend и оставляет цикл скалярным).
+//Редукция Коди-Уэйта x = n * ln2 + r, |r| <= ln2 / 2, e^r - ряд Тейлора до r^13,
+//2^n собирается прямо в битах double.
+//Относительная погрешность на [-708, 708] не больше MAX_REL_ERROR (~2 ulp),
+//за пределами аргумент обрезается (e^-708 ~ 3e-308 вместо 0 и e^708 вместо inf).
+class VecMath
+{
+	static constexpr double LOG2E = 1.4426950408889634;
+	static constexpr double LN2_HI = 6.93147180369123816490e-01;
+	static constexpr double LN2_LO = 1.90821492927058770002e-10;
+	static constexpr double ROUND_MAGIC = 6755399441055744.0;//1.5 * 2^52
+	static constexpr double LIMIT = 708.0;
+
+	static double bitsToDouble(uint64_t v) {double ret; std::memcpy(&ret, &v, sizeof(ret)); return ret;};
+	static uint64_t doubleToBits(double v) {uint64_t ret; std::memcpy(&ret, &v, sizeof(ret)); return ret;};
+public:
+	static constexpr double MAX_REL_ERROR = 5.e-16;
+
+	static double exp(double x)
+	{
+		x = std::max(std::min(x, LIMIT), -LIMIT);
+		//после сложения с ROUND_MAGIC младшие биты мантиссы t содержат round(x / ln2)
+		double t = (x * LOG2E) + ROUND_MAGIC;
+		double n = t - ROUND_MAGIC;
+		double r = (x - (n * LN2_HI)) - (n * LN2_LO);
+
+		double p = 1.0 / 6227020800.0;
+		p = (p * r) + (1.0 / 479001600.0);
+		p = (p * r) + (1.0 / 39916800.0);
+		p = (p * r) + (1.0 / 3628800.0);
+		p = (p * r) + (1.0 / 362880.0);
+		p = (p * r) + (1.0 / 40320.0);
+		p = (p * r) + (1.0 / 5040.0);
+		p = (p * r) + (1.0 / 720.0);
+		p = (p * r) + (1.0 / 120.0);
+		p = (p * r) + (1.0 / 24.0);
+		p = (p * r) + (1.0 / 6.0);
+		p = (p * r) + 0.5;
+		p = (p * r) + 1.0;
+		p = (p * r) + 1.0;
+
+		uint64_t scale = (doubleToBits(t) << 52) + doubleToBits(1.0);//2^n
+		return p * bitsToDouble(scale);
+	};
+	static double sigmoid(double arg) {return 1.0 / (1.0 + exp(-arg));};
+	//x^p = e^(p * ln x) при заранее посчитанном ln x
+	static double powFromLog(double lnX, double p) {return exp(p * lnX);};
+
+	friend class FastMath;
+};
+
+//Политики вычисления трансцендентных функций на пути оценки стратегии
+//(признаки в User, степени признаков и активация в Strat::get).
+//Выбираются при компиляции параметром шаблона, по умолчанию StratMath.
+
+//точные функции libm
+class ExactMath
+{
+public:
+	static constexpr const char* NAME = "exact";
+	static constexpr double MAX_REL_ERROR = 0.0;
+	static double exp(double x) {return std::exp(x);};
+	static double log(double x) {return std::log(x);};
+	static double pow(double x, double p) {return std::pow(x, p);};
+	static double sigmoid(double arg) {return 1.0 / (1.0 + std::exp(-arg));};
+};
+
+//полиномиальные приближения:
+//exp - та же редукция, что в VecMath, но ряд Тейлора до r^6, относительная погрешность < 2e-7;
+//log - x = m * 2^e, m в [sqrt(0.5), sqrt(2)), ln m = 2 atanh(s) рядом до s^7,
+//абсолютная погрешность < 3e-8;
+//pow(x, p) = exp(p * log(x)) для x > 0 и 0 иначе (степени признаков положительны),
+//относительная погрешность < MAX_REL_ERROR при p <= 20
+class FastMath
+{
+	static constexpr double SQRT2 = 1.4142135623730951;
+public:
+	static constexpr const char* NAME = "fast";
+	static constexpr double MAX_REL_ERROR = 1.e-6;
+	static double exp(double x)
+	{
+		x = std::max(std::min(x, VecMath::LIMIT), -VecMath::LIMIT);
+		double t = (x * VecMath::LOG2E) + VecMath::ROUND_MAGIC;
+		double n = t - VecMath::ROUND_MAGIC;
+		double r = (x - (n * VecMath::LN2_HI)) - (n * VecMath::LN2_LO);
+
+		double p = 1.0 / 720.0;
+		p = (p * r) + (1.0 / 120.0);
+		p = (p * r) + (1.0 / 24.0);
+		p = (p * r) + (1.0 / 6.0);
+		p = (p * r) + 0.5;
+		p = (p * r) + 1.0;
+		p = (p * r) + 1.0;
+
+		uint64_t scale = (VecMath::doubleToBits(t) << 52) + VecMath::doubleToBits(1.0);
+		return p * VecMath::bitsToDouble(scale);
+	};
+	static double log(double x)//x > 0, нормализованное
+	{
+		uint64_t bits = VecMath::doubleToBits(x);
+		double e = static_cast<double>(static_cast<int64_t>(bits >> 52) - 1023);
+		double m = VecMath::bitsToDouble((bits & 0x000fffffffffffffULL) | VecMath::doubleToBits(1.0));//[1, 2)
+		if(m > SQRT2)
+		{
+			m *= 0.5;
+			e += 1.0;
+		}
+		double s = (m - 1.0) / (m + 1.0);
+		double s2 = s * s;
+		double p = 1.0 / 7.0;
+		p = (p * s2) + (1.0 / 5.0);
+		p = (p * s2) + (1.0 / 3.0);
+		p = (p * s2) + 1.0;
+		return (2.0 * s * p) + (e * VecMath::LN2_HI) + (e * VecMath::LN2_LO);
+	};
+	static double pow(double x, double p) {return (x > 0.0) ? exp(p * log(x)) : 0.0;};
+	static double sigmoid(double arg) {return 1.0 / (1.0 + exp(-arg));};
+};
+
+#endif /* VECMATH_H_ */